@@ -77,44 +77,96 @@ class Environment():
         self.api.setMode(self.api_mode)
         self.cam = self.api.getCamera()
 
-    def set_render_mode(self, mode):
-        """
-        Args:
-            mode (str or enum): either a RenderMode value or its string version.
-                                'rgb', 'depth', 'semantic', 'instance', or 'invdepth'
-        """
+    def _parse_render_mode(self, mode):
         mappings = {
             'rgb': RenderMode.RGB,
             'depth': RenderMode.DEPTH,
             'semantic': RenderMode.SEMANTIC,
             'instance': RenderMode.INSTANCE,
             'invdepth': RenderMode.INVDEPTH,
+            'depth_float': RenderMode.DEPTH_FLOAT,
         }
         if isinstance(mode, six.string_types):
-            mode = mode.lower()
-            self.api_mode = mappings[mode]
-        else:
-            assert mode in set(mappings.values())
-            self.api_mode = mode
+            return mappings[mode.lower()]
+        assert mode in set(mappings.values())
+        return mode
+
+    def set_render_mode(self, mode):
+        """
+        Args:
+            mode (str or enum): either a RenderMode value or its string version.
+                                'rgb', 'depth', 'semantic', 'instance', 'invdepth', or 'depth_float'
+        """
+        self.api_mode = self._parse_render_mode(mode)
         self.api.setMode(self.api_mode)
 
-    def render(self, mode=None, copy=False):
+    def render(self, mode=None, copy=False, out=None, index=None):
         """
         Args:
             mode (str or enum or None): If None, use the current mode.
+            out (np.ndarray or None): If not None, render into this array instead of
+                allocating a new one. It has to be a writable, C-contiguous array
+                with the shape and dtype of the image, or with one more leading
+                batch dimension when `index` is given.
+            index (int or None): render into out[index].
 
         Returns:
-            An image.
+            An image. It is a (h, w) float32 array of depth in meters in
+            'depth_float' mode, and a uint8 array of (h, w, c) otherwise.
         """
-        if mode is None:
-            return np.array(self.api.render(), copy=copy)
-        else:
+        if mode is not None:
             backup = self.api_mode
             self.set_render_mode(mode)
+        if out is None:
             ret = np.array(self.api.render(), copy=copy)
+        elif index is None:
+            self.api.render(out)
+            ret = out
+        else:
+            self.api.render(out, index)
+            ret = out[index]
+        if mode is not None:
             self.set_render_mode(backup)
-            return ret
+        return ret
+
+    def render_multi(self, modes, copy=False):
+        """
+        Render several modes with a single pass over the scene.
+
+        Args:
+            modes (list of str or enum): see `set_render_mode`.
 
+        Returns:
+            A list of images, one for each mode. Each is the same as `render(mode)`.
+        """
+        modes = [self._parse_render_mode(m) for m in modes]
+        return [np.array(k, copy=copy) for k in self.api.renderMulti(modes)]
+
+    def render_batch(self, cameras, mode=None, out=None):
+        """
+        Render the scene from several cameras, with a single readback for all of them.
+
+        Args:
+            cameras (list of objrender.Camera): the views to render.
+                The camera of the environment is not changed.
+            mode (str or enum or None): If None, use the current mode.
+            out (np.ndarray or None): If not None, render into this array instead of
+                allocating a new one.
+
+        Returns:
+            An array of (N, ) + the shape of `render(mode)`.
+        """
+        if mode is not None:
+            backup = self.api_mode
+            self.set_render_mode(mode)
+        if out is None:
+            ret = self.api.renderBatch(cameras)
+        else:
+            self.api.renderBatch(cameras, out)
+            ret = out
+        if mode is not None:
+            self.set_render_mode(backup)
+        return ret
 
     def render_cube_map(self, mode=None, copy=False):
         """
@@ -380,6 +432,17 @@ class MultiHouseEnv(Environment):
             self.house = self.all_houses[house_id]
         self._load_objects()
 
+    def prefetch_house(self, house_id):
+        """
+        Start loading a house in the background, so that a later
+        reset_house(house_id) does not have to wait for it.
+
+        Args:
+            house_id (int): a integer in range(0, self.num_house).
+        """
+        house = self.all_houses[house_id]
+        self.api.prefetchScene(house.objFile, house.metaDataFile, self.config['colorFile'])
+
     def cache_shortest_distance(self):
         # TODO
         for house in self.all_houses:
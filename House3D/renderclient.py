@@ -0,0 +1,248 @@
+# Copyright 2017-present, Facebook, Inc.
+# All rights reserved.
+#
+# This source code is licensed under the license found in the
+# LICENSE file in the root directory of this source tree.
+"""
+Client of renderer/render-server.bin, which renders for all the processes on a node
+with one set of GL contexts, so that each scene is loaded once per node instead of
+once per process:
+
+    ./render-server.bin -w 120 -h 90 -d 0,1 /tmp/house3d.sock
+
+    api = RenderClient('/tmp/house3d.sock')
+    env = Environment(api, house_id, cfg)
+
+RenderClient has the same methods as RenderAPI, except renderBatch, renderMulti
+and renderCubeMap. The resolution is set by the server.
+Frames are written by the server into shared memory, not sent over the socket.
+
+Requires Python 3 and Linux.
+"""
+
+import array
+import collections
+import mmap
+import os
+import socket
+import struct
+
+import numpy as np
+
+from .objrender import Camera, RenderMode, Vec3
+
+__all__ = ['RenderClient']
+
+# These have to match renderer/suncg/server.hh
+PROTOCOL_VERSION = 1
+LOAD_SCENE, PREFETCH_SCENE, RENDER, GET_NAME = 1, 2, 3, 4
+_REQUEST = struct.Struct('=4i8f3i')
+_REPLY = struct.Struct('=4i5f')
+_HELLO = struct.Struct('=I3iQ')
+_MAX_REPLY_SIZE = 65536
+
+Geometry = collections.namedtuple('Geometry', ['w', 'h'])
+
+
+class RenderClient(object):
+    def __init__(self, socket_path):
+        """
+        Args:
+            socket_path: the socket render-server.bin listens on.
+        """
+        self._sock = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+        self._sock.connect(socket_path)
+        fds = array.array('i')
+        msg, ancdata, _, _ = self._sock.recvmsg(
+            _HELLO.size, socket.CMSG_SPACE(fds.itemsize))
+        for level, type, data in ancdata:
+            if level == socket.SOL_SOCKET and type == socket.SCM_RIGHTS:
+                fds.frombytes(data[:len(data) - len(data) % fds.itemsize])
+        if len(msg) != _HELLO.size or not fds:
+            raise ConnectionError('Unexpected handshake from the render server!')
+        version, w, h, self._num_slots, self._slot_bytes = _HELLO.unpack(msg)
+        if version != PROTOCOL_VERSION:
+            os.close(fds[0])
+            raise ConnectionError('Render server speaks protocol {}, expected {}!'.format(
+                version, PROTOCOL_VERSION))
+        self._ring = mmap.mmap(fds[0], self._num_slots * self._slot_bytes)
+        os.close(fds[0])
+
+        self._geo = Geometry(w, h)
+        self._scene = -1
+        self._camera = None
+        self._mode = RenderMode.RGB
+        self._next_slot = 0
+        # (slot, mode) of the frames started by renderAsync(), oldest first
+        self._pending = collections.deque()
+        # slot -> (status, error message) of the frames rendered but not fetched
+        self._finished = {}
+
+    def close(self):
+        self._sock.close()
+        self._ring.close()
+
+    def loadScene(self, obj_file, model_category_file, semantic_label_file):
+        """
+        See RenderAPI.loadScene. The scene is loaded by the server if no other
+        client has loaded it.
+        """
+        reply, _ = self._call(LOAD_SCENE, self._paths(
+            obj_file, model_category_file, semantic_label_file))
+        self._scene = reply[2]
+        pos, yaw, pitch = Vec3(*reply[4:7]), reply[7], reply[8]
+        self._camera = Camera(pos, yaw, pitch)
+
+    loadSceneSUNCG = loadScene
+
+    def prefetchScene(self, obj_file, model_category_file, semantic_label_file):
+        self._send(PREFETCH_SCENE, payload=self._paths(
+            obj_file, model_category_file, semantic_label_file))
+
+    def getCamera(self):
+        """
+        The camera is local: its pose is sent with each frame.
+        """
+        return self._camera
+
+    def setMode(self, mode):
+        self._mode = mode
+
+    def getMode(self):
+        return self._mode
+
+    def resolution(self):
+        return self._geo
+
+    def numChannels(self):
+        return {RenderMode.DEPTH: 2, RenderMode.DEPTH_FLOAT: 1}.get(self._mode, 3)
+
+    def render(self, out=None, index=None):
+        """
+        Same as RenderAPI.render: returns a new array if `out` is None,
+        otherwise writes to `out`, or `out[index]` if index is given.
+        """
+        shape, dtype = self._image_format(self._mode)
+        if out is not None:
+            if index is not None:
+                if out.ndim != len(shape) + 1 or not 0 <= index < out.shape[0]:
+                    raise IndexError('Cannot write to index {} of the batch!'.format(index))
+                self._check_output(out, (out.shape[0], ) + shape, dtype)
+                out = out[index]
+            else:
+                self._check_output(out, shape, dtype)
+        slot = self._start_frame()
+        self._wait_frame(slot)
+        image = self._frame(slot, self._mode)
+        if out is None:
+            return image.copy()
+        np.copyto(out, image)
+
+    def renderAsync(self):
+        """
+        Start rendering a frame with the current camera and mode, without waiting for it.
+        Up to numSlots() frames can be in flight.
+        """
+        self._pending.append((self._start_frame(), self._mode))
+
+    def fetch(self):
+        """
+        Wait for the oldest frame started by renderAsync() and return it.
+        """
+        if not self._pending:
+            raise RuntimeError('No frame to fetch!')
+        slot, mode = self._pending.popleft()
+        self._wait_frame(slot)
+        return self._frame(slot, mode).copy()
+
+    def numPendingFrames(self):
+        return len(self._pending)
+
+    def numSlots(self):
+        return self._num_slots
+
+    def getNameFromInstanceColor(self, r, g, b):
+        _, name = self._call(GET_NAME, color=(r, g, b))
+        return name
+
+    def _paths(self, *paths):
+        return b''.join(os.path.abspath(p).encode('utf-8') + b'\0' for p in paths)
+
+    def _send(self, type, slot=-1, color=(0, 0, 0), payload=b''):
+        cam = self._camera
+        if cam is None:
+            pose = (0, 0, 0, 0, 0, 0, 0, 0)
+        else:
+            pose = (cam.pos.x, cam.pos.y, cam.pos.z, cam.yaw, cam.pitch,
+                    cam.near, cam.far, cam.vertical_fov)
+        msg = _REQUEST.pack(type, self._scene, int(self._mode), slot, *(pose + tuple(color)))
+        self._sock.send(msg + payload)
+
+    # Receive one reply, and keep it in self._finished if it's a frame
+    def _receive(self):
+        data = self._sock.recv(_MAX_REPLY_SIZE)
+        if not data:
+            raise ConnectionError('Render server closed the connection!')
+        reply = _REPLY.unpack_from(data)
+        text = data[_REPLY.size:].decode('utf-8', 'replace')
+        if reply[0] == RENDER:
+            self._finished[reply[3]] = (reply[1], text)
+            return None
+        if reply[1] != 0:
+            raise RuntimeError(text)
+        return reply, text
+
+    # Send a request and wait for its reply
+    def _call(self, type, payload=b'', color=(0, 0, 0)):
+        # the server takes at most numSlots() requests in flight from a client
+        while sum(s not in self._finished for s, _ in self._pending) >= self._num_slots:
+            self._receive()
+        self._send(type, color=color, payload=payload)
+        while True:
+            ret = self._receive()
+            if ret is not None:
+                return ret
+
+    def _start_frame(self):
+        if self._scene < 0:
+            raise RuntimeError('No scene is loaded!')
+        if len(self._pending) >= self._num_slots:
+            raise RuntimeError('Too many frames in flight!')
+        # skip the slots of the frames not fetched yet, which render() doesn't take
+        busy = set(s for s, _ in self._pending)
+        slot = self._next_slot
+        while slot in busy:
+            slot = (slot + 1) % self._num_slots
+        self._next_slot = (slot + 1) % self._num_slots
+        self._send(RENDER, slot=slot)
+        return slot
+
+    def _wait_frame(self, slot):
+        while slot not in self._finished:
+            self._receive()
+        status, text = self._finished.pop(slot)
+        if status != 0:
+            raise RuntimeError(text)
+
+    def _image_format(self, mode):
+        h, w = self._geo.h, self._geo.w
+        if mode == RenderMode.DEPTH_FLOAT:
+            return (h, w), np.float32
+        return (h, w, 2 if mode == RenderMode.DEPTH else 3), np.uint8
+
+    # A view of the frame in the ring, which is valid until the slot is reused
+    def _frame(self, slot, mode):
+        shape, dtype = self._image_format(mode)
+        count = int(np.prod(shape))
+        return np.frombuffer(self._ring, dtype=dtype, count=count,
+                             offset=slot * self._slot_bytes).reshape(shape)
+
+    def _check_output(self, out, shape, dtype):
+        if out.dtype != dtype:
+            raise TypeError('Output array must have dtype {}!'.format(np.dtype(dtype).name))
+        if not out.flags.writeable:
+            raise ValueError('Output array must be writable!')
+        if not out.flags.c_contiguous:
+            raise ValueError('Output array must be C-contiguous!')
+        if out.shape != shape:
+            raise ValueError('Output array must have shape {}!'.format(shape))
@@ -232,18 +232,36 @@ class RoomNavTask(gym.Env):
         # generate state
         x, y = self.house.to_coor(gx, gy, True)
         self.env.reset(x=x, y=y)
-        self.last_obs = self.env.render()
-        if self.joint_visual_signal:
-            self.last_obs = np.concatenate([self.env.render(mode='rgb'), self.last_obs], axis=-1)
+        self.last_obs, dep_sig = self._render_observation()
         ret_obs = self.last_obs
         if self.depth_signal:
-            dep_sig = self.env.render(mode='depth')
-            if dep_sig.shape[-1] > 1:
-                dep_sig = dep_sig[..., 0:1]
             ret_obs = np.concatenate([ret_obs, dep_sig], axis=-1)
         self.last_info = self.info
         return ret_obs
 
+    def _render_observation(self):
+        """
+        Render all the visual signals needed by the observation in one pass.
+
+        Returns:
+            visual observation, and the depth signal (None if depth_signal is False)
+        """
+        modes = [self.env.api_mode]
+        if self.joint_visual_signal:
+            modes.append(RenderMode.RGB)
+        if self.depth_signal:
+            modes.append(RenderMode.DEPTH)
+        imgs = self.env.render_multi(modes)
+        obs = imgs[0]
+        if self.joint_visual_signal:
+            obs = np.concatenate([imgs[1], obs], axis=-1)
+        dep_sig = None
+        if self.depth_signal:
+            dep_sig = imgs[-1]
+            if dep_sig.shape[-1] > 1:
+                dep_sig = dep_sig[..., 0:1]
+        return obs, dep_sig
+
     def _apply_action(self, action):
         if self.discrete_action:
             return discrete_actions[action]
@@ -301,9 +319,8 @@ class RoomNavTask(gym.Env):
             if flag_print_debug_info:
                 print('Move Successfully!')
 
-        self.last_obs = obs = self.env.render()
-        if self.joint_visual_signal:
-            self.last_obs = obs = np.concatenate([self.env.render(mode='rgb'), obs], axis=-1)
+        obs, dep_sig = self._render_observation()
+        self.last_obs = obs
         cur_info = self.info
         raw_dist = cur_info['dist']
         orig_raw_dist = self.last_info['dist']
@@ -351,9 +368,6 @@ class RoomNavTask(gym.Env):
                 reward += object_reward
 
         if self.depth_signal:
-            dep_sig = self.env.render(mode='depth')
-            if dep_sig.shape[-1] > 1:
-                dep_sig = dep_sig[..., 0:1]
             obs = np.concatenate([obs, dep_sig], axis=-1)
         self.last_info = cur_info
         return obs, reward, done, cur_info
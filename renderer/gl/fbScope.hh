@@ -7,6 +7,7 @@
 
 
 #pragma once
+#include <vector>
 #include "api.hh"
 
 #include "lib/geometry.hh"
@@ -19,21 +20,51 @@ namespace render {
 
 class Framebuffer {
   public:
-    explicit Framebuffer(Geometry win_size): win_size_{win_size} {
+    // num_color_attachments: number of color buffers to attach.
+    // Fragment output at location i is written to GL_COLOR_ATTACHMENTi.
+    // color_format: internal format of all color buffers, either GL_RGBA8 or GL_R32F.
+    explicit Framebuffer(Geometry win_size, int num_color_attachments=1,
+        GLenum color_format=GL_RGBA8):
+      win_size_{win_size}, num_color_{num_color_attachments},
+      color_format_{color_format} {
+      m_assert(color_format_ == GL_RGBA8 || color_format_ == GL_R32F);
       if (glGenFramebuffers == nullptr)
         error_exit("Pointer to glGenFramebuffers wasn't setup properly!");
+      GLint max_attachments = 0;
+      glGetIntegerv(GL_MAX_COLOR_ATTACHMENTS, &max_attachments);
+      if (num_color_ < 1 || num_color_ > max_attachments)
+        error_exit(ssprintf("Cannot create %d color attachments (max=%d)!",
+              num_color_, max_attachments));
 
       glGenFramebuffers(1, &fbo);
-      glGenRenderbuffers(2, rbo);
-      glBindRenderbuffer(GL_RENDERBUFFER, rbo[0]);
-      glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, win_size_.w, win_size_.h);
+      rbo_color_.resize(num_color_);
+      glGenRenderbuffers(num_color_, rbo_color_.data());
+      glGenRenderbuffers(1, &rbo_depth_);
+      for (auto rbo : rbo_color_) {
+        glBindRenderbuffer(GL_RENDERBUFFER, rbo);
+        glRenderbufferStorage(GL_RENDERBUFFER, color_format_, win_size_.w, win_size_.h);
+      }
 
-      glBindRenderbuffer(GL_RENDERBUFFER, rbo[1]);
+      glBindRenderbuffer(GL_RENDERBUFFER, rbo_depth_);
       glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, win_size_.w, win_size_.h);
 
+      // target of the vertical flip done before reading pixels
+      glGenFramebuffers(1, &flip_fbo_);
+      glGenRenderbuffers(1, &flip_rbo_);
+      glBindRenderbuffer(GL_RENDERBUFFER, flip_rbo_);
+      glRenderbufferStorage(GL_RENDERBUFFER, color_format_, win_size_.w, win_size_.h);
+      glBindFramebuffer(GL_FRAMEBUFFER, flip_fbo_);
+      glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, flip_rbo_);
+      GLenum flip_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+      if (flip_status != GL_FRAMEBUFFER_COMPLETE)
+        error_exit(
+          ssprintf("ERROR::FRAMEBUFFER: Framebuffer is not complete! ErrorCode=%d\n", flip_status));
+
       glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-      glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rbo[0]);
-      glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, rbo[1]);
+      for (int i = 0; i < num_color_; ++i)
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i,
+            GL_RENDERBUFFER, rbo_color_[i]);
+      glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, rbo_depth_);
 
       glBindRenderbuffer(GL_RENDERBUFFER, 0);
 
@@ -41,42 +72,94 @@ class Framebuffer {
       if (status != GL_FRAMEBUFFER_COMPLETE)
         error_exit(
           ssprintf("ERROR::FRAMEBUFFER: Framebuffer is not complete! ErrorCode=%d\n", status));
+      std::vector<bool> only_first(num_color_, false);
+      only_first[0] = true;
+      setDrawBuffers(only_first);
     }
 
     void bind() const { glBindFramebuffer(GL_FRAMEBUFFER, fbo); }
 
     void unbind() const { glBindFramebuffer(GL_FRAMEBUFFER, 0); }
 
-    Matuc capture() const {
-      Matuc ret{win_size_.h, win_size_.w, 4};
+    int num_color_attachments() const { return num_color_; }
+
+    Geometry size() const { return win_size_; }
+
+    // Route fragment output i to color attachment i if enabled[i] is true,
+    // and discard it otherwise. The framebuffer has to be bound.
+    void setDrawBuffers(const std::vector<bool>& enabled) const {
+      m_assert((int)enabled.size() == num_color_);
+      std::vector<GLenum> bufs(num_color_, GL_NONE);
+      for (int i = 0; i < num_color_; ++i)
+        if (enabled[i])
+          bufs[i] = GL_COLOR_ATTACHMENT0 + i;
+      glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+      glDrawBuffers(num_color_, bufs.data());
+    }
+
+    bool is_float() const { return color_format_ == GL_R32F; }
+
+    // Read the given color attachment as a 3-channel image
+    Matuc capture(int attachment=0) const {
+      m_assert(!is_float());
+      Matuc ret{win_size_.h, win_size_.w, 3};
+      capture(ret.ptr(), attachment);
+      return ret;
+    }
+
+    // Read the given color attachment of a GL_R32F framebuffer as a 1-channel image
+    Mat32f captureFloat(int attachment=0) const {
+      m_assert(is_float());
+      Mat32f ret{win_size_.h, win_size_.w, 1};
+      capture(ret.ptr(), attachment);
+      return ret;
+    }
+
+    // Read the given color attachment into `dst`, which has to hold
+    // h * w * 3 bytes for GL_RGBA8 (RGB image), or h * w floats for GL_R32F.
+    // If a GL_PIXEL_PACK_BUFFER is bound, `dst` is an offset into that buffer.
+    // If num_rows >= 0, only read the top num_rows rows of the image.
+    // The framebuffer has to be bound.
+    void capture(void* dst, int attachment=0, int num_rows=-1) const {
+      m_assert(attachment < num_color_);
+      m_assert(num_rows <= win_size_.h);
+      if (num_rows < 0)
+        num_rows = win_size_.h;
+      int y0 = win_size_.h - num_rows;
+      // opengl stores the image bottom-up. Flip it on the GPU,
+      // so the pixels can be read in the usual orientation without CPU work.
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+      glReadBuffer(GL_COLOR_ATTACHMENT0 + attachment);
+      glBindFramebuffer(GL_DRAW_FRAMEBUFFER, flip_fbo_);
+      glBlitFramebuffer(0, y0, win_size_.w, win_size_.h,
+          0, num_rows, win_size_.w, 0, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, flip_fbo_);
       glReadBuffer(GL_COLOR_ATTACHMENT0);
-      glReadPixels(0, 0, win_size_.w, win_size_.h,
-          GL_RGBA, GL_UNSIGNED_BYTE, ret.ptr());
-      // opengl returns a vertical-flipped image.
-
-
-      Matuc ret3{win_size_.h, win_size_.w, 3};
-      for (int i = 0; i < ret3.height(); ++i) {
-        unsigned char* oldptr = ret.ptr(i);
-        unsigned char* newptr = ret3.ptr(win_size_.h - 1 - i);
-        for (int j = 0; j < ret3.width(); ++j) {
-          *(newptr++) = *(oldptr++);
-          *(newptr++) = *(oldptr++);
-          *(newptr++) = *(oldptr++);
-          oldptr ++;
-        }
-      }
-      return ret3;
+      // rows of pixels are tightly packed
+      glPixelStorei(GL_PACK_ALIGNMENT, 1);
+      if (is_float())
+        glReadPixels(0, 0, win_size_.w, num_rows, GL_RED, GL_FLOAT, dst);
+      else
+        glReadPixels(0, 0, win_size_.w, num_rows, GL_RGB, GL_UNSIGNED_BYTE, dst);
+      bind();
     }
 
     ~Framebuffer() {
       glDeleteFramebuffers(1, &fbo);
-      glDeleteRenderbuffers(2, rbo);
+      glDeleteRenderbuffers(num_color_, rbo_color_.data());
+      glDeleteRenderbuffers(1, &rbo_depth_);
+      glDeleteFramebuffers(1, &flip_fbo_);
+      glDeleteRenderbuffers(1, &flip_rbo_);
     }
 
   protected:
-    GLuint fbo, rbo[2];
+    GLuint fbo, rbo_depth_;
+    std::vector<GLuint> rbo_color_;
+    GLuint flip_fbo_, flip_rbo_;
     Geometry win_size_;
+    int num_color_;
+    GLenum color_format_;
 };
 
 
@@ -87,7 +170,12 @@ class FramebufferScope {
     explicit FramebufferScope(const Framebuffer& fb) :
       fb_{fb} { fb.bind(); }
 
-    Matuc capture() const { return fb_.capture(); }
+    Matuc capture(int attachment=0) const { return fb_.capture(attachment); }
+
+    Mat32f captureFloat(int attachment=0) const { return fb_.captureFloat(attachment); }
+
+    void capture(void* dst, int attachment=0, int num_rows=-1) const
+    { fb_.capture(dst, attachment, num_rows); }
 
     ~FramebufferScope() { fb_.unbind(); }
 
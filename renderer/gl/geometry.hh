@@ -23,6 +23,17 @@ struct Vertex final {
 
 typedef std::array<Vertex, 3> TriangleFace;
 
+// Layout of Vertex in GPU memory
+enum class VertexFormat {
+  // 32 bytes: float pos, normal and texcoord, the same as Vertex
+  FLOAT = 0,
+  // 20 bytes: float pos, normal as GL_INT_2_10_10_10_REV, half-float texcoord.
+  // Texcoords larger than a few hundreds lose sub-texel precision.
+  COMPACT = 1,
+  // 16 bytes: same as COMPACT without texcoord. Only for rendering without textures.
+  COMPACT_NO_TEXCOORD = 2
+};
+
 // compute normal direction of a triangle
 inline glm::vec3 calcNormal(glm::vec3 v0, glm::vec3 v1, glm::vec3 v2) {
   auto v10 = v1 - v0,
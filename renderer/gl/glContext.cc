@@ -11,8 +11,13 @@
 #include "glContext.hh"
 #include <iostream>
 #include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
 
 #ifdef __linux__
+#include <cstdlib>
+#include <cstring>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -28,6 +33,15 @@ namespace {
 std::atomic_int NUM_EGLCONTEXT_ALIVE{0};
 
 #ifdef __linux__
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+// Contexts alive on each EGL display. Contexts on the same device get the same display,
+// which is terminated with its last context, so that it stays valid for the shared contexts.
+std::mutex EGL_DISPLAY_MUTEX;
+std::map<EGLDisplay, int> EGL_DISPLAY_REFCOUNT;
+
 const EGLint EGLconfigAttribs[] = {
   EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
   EGL_BLUE_SIZE, 8,
@@ -38,6 +52,14 @@ const EGLint EGLconfigAttribs[] = {
   EGL_NONE
 };
 
+// OpenGL 3.3 core profile. Old versions of Mesa only support 3.3 in core profile.
+const EGLint EGLcoreContextAttribs[] = {
+  EGL_CONTEXT_MAJOR_VERSION_KHR, 3,
+  EGL_CONTEXT_MINOR_VERSION_KHR, 3,
+  EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT_KHR,
+  EGL_NONE
+};
+
 // const EGLint EGLpbufferAttribs[] = {
 //   EGL_WIDTH, 9,
 //   EGL_HEIGHT, 9,
@@ -45,6 +67,32 @@ const EGLint EGLconfigAttribs[] = {
 // };
 
 
+// Set an environment variable, and restore its old value at the end of the scope
+class ScopedEnv {
+  public:
+    ScopedEnv(const char* name, const string& value): name_{name} {
+      const char* old = getenv(name);
+      if (old) {
+        had_old_ = true;
+        old_ = old;
+      }
+      setenv(name, value.c_str(), 1);
+    }
+    ~ScopedEnv() {
+      if (had_old_)
+        setenv(name_, old_.c_str(), 1);
+      else
+        unsetenv(name_);
+    }
+    ScopedEnv(const ScopedEnv&) = delete;
+    ScopedEnv& operator = (const ScopedEnv&) = delete;
+
+  private:
+    const char* name_;
+    bool had_old_ = false;
+    string old_;
+};
+
 bool check_nvidia_readable(int device) {
   string dev = ssprintf("/dev/nvidia%d", device);
   int ret = open(dev.c_str(), O_RDONLY);
@@ -129,17 +177,15 @@ GLFWContext::~GLFWContext() {
 
 #ifdef __linux__
 // https://devblogs.nvidia.com/parallelforall/egl-eye-opengl-visualization-without-x-server/
-EGLContext::EGLContext(Geometry win_size, int device): GLContext{win_size} {
+EGLContext::EGLContext(Geometry win_size, int device, const EGLContext* share):
+  GLContext{win_size, share}, device_{device} {
   NUM_EGLCONTEXT_ALIVE.fetch_add(1);
-  auto checkError = [](EGLBoolean succ) {
-    EGLint err = eglGetError();
-    if (err != EGL_SUCCESS)
-      error_exit(ssprintf("EGL error: %d\n", err));
-    if (!succ)
-      error_exit("EGL failed!\n");
-  };
+  if (share && share->device_ != device)
+    error_exit(ssprintf("[EGL] Cannot share objects between device %d and %d!",
+          share->device_, device));
 
-  // 1. Initialize EGL
+  // 1. Get the display of the device
+  EGLDisplay dpy;
   {
     static const int MAX_DEVICES = 16;
     EGLDeviceEXT eglDevs[MAX_DEVICES];
@@ -180,11 +226,32 @@ EGLContext::EGLContext(Geometry win_size, int device): GLContext{win_size} {
           " devices are accessible. Using device " << device << " whose physical id is " << visible_devices[device] << "." << endl;
       device = visible_devices[device];
     }
-    eglDpy_ = eglGetPlatformDisplayEXT(EGL_PLATFORM_DEVICE_EXT, eglDevs[device], 0);
+    dpy = eglGetPlatformDisplayEXT(EGL_PLATFORM_DEVICE_EXT, eglDevs[device], 0);
   }
+  create_(dpy, share);
+}
+
+EGLContext::EGLContext(Geometry win_size, const EGLContext* share):
+  GLContext{win_size, share} {
+  NUM_EGLCONTEXT_ALIVE.fetch_add(1);
+}
+
+void EGLContext::create_(EGLDisplay dpy, const EGLContext* share, const EGLint* context_attribs) {
+  auto checkError = [](EGLBoolean succ) {
+    EGLint err = eglGetError();
+    if (err != EGL_SUCCESS)
+      error_exit(ssprintf("EGL error: %d\n", err));
+    if (!succ)
+      error_exit("EGL failed!\n");
+  };
+  eglDpy_ = dpy;
 
   EGLint major, minor;
 
+  {
+    std::lock_guard<std::mutex> lg(EGL_DISPLAY_MUTEX);
+    EGL_DISPLAY_REFCOUNT[eglDpy_]++;
+  }
   EGLBoolean succ = eglInitialize(eglDpy_, &major, &minor);
   if (!succ) {
     error_exit("Failed to initialize EGL display!");
@@ -213,7 +280,8 @@ EGLContext::EGLContext(Geometry win_size, int device): GLContext{win_size} {
   checkError(succ);
 
   // 5. Create a context and make it current
-  eglCtx_ = eglCreateContext(eglDpy_, eglCfg, (::EGLContext)0, NULL);
+  eglCtx_ = eglCreateContext(eglDpy_, eglCfg,
+      share ? share->eglCtx_ : (::EGLContext)0, context_attribs);
   checkError(succ);
   succ = eglMakeCurrent(eglDpy_, eglSurf, eglSurf, eglCtx_);
   if (!succ)
@@ -229,10 +297,40 @@ EGLContext::~EGLContext() {
   // print_debug("Inside ~EGLContext, #alive contexts=%d\n", num_alive);
   // 6. Terminate EGL when finished
   eglDestroyContext(eglDpy_, eglCtx_);
-  eglTerminate(eglDpy_);
+  std::lock_guard<std::mutex> lg(EGL_DISPLAY_MUTEX);
+  if (--EGL_DISPLAY_REFCOUNT[eglDpy_] == 0) {
+    EGL_DISPLAY_REFCOUNT.erase(eglDpy_);
+    eglTerminate(eglDpy_);
+  }
+}
+
+SoftwareEGLContext::SoftwareEGLContext(Geometry win_size, int num_threads,
+    const SoftwareEGLContext* share): EGLContext{win_size, share} {
+  const char* extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  PFNEGLGETPLATFORMDISPLAYEXTPROC eglGetPlatformDisplayEXT =
+    (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+  if (extensions == nullptr || !strstr(extensions, "EGL_MESA_platform_surfaceless") ||
+      !eglGetPlatformDisplayEXT)
+    error_exit("[EGL] EGL_MESA_platform_surfaceless is unsupported! Software rendering requires Mesa.");
+
+  EGLDisplay dpy = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+  if (dpy == EGL_NO_DISPLAY)
+    error_exit("[EGL] Cannot get the surfaceless display!");
+  // Mesa reads these when the display is initialized, in create_().
+  // Without LIBGL_ALWAYS_SOFTWARE, it would use a GPU if there is one.
+  // They are only set meanwhile, so that GPU contexts created later in the
+  // process and child processes are not affected.
+  static std::mutex env_mutex;
+  std::lock_guard<std::mutex> lg(env_mutex);
+  ScopedEnv software{"LIBGL_ALWAYS_SOFTWARE", "1"};
+  unique_ptr<ScopedEnv> threads;
+  if (num_threads > 0)
+    threads.reset(new ScopedEnv{"LP_NUM_THREADS", to_string(num_threads)});
+  create_(dpy, share, EGLcoreContextAttribs);
 }
 
-GLXHeadlessContext::GLXHeadlessContext(Geometry win_size): GLContext{win_size} {
+GLXHeadlessContext::GLXHeadlessContext(Geometry win_size, const GLXHeadlessContext* share):
+  GLContext{win_size, share} {
   dpy_ = XOpenDisplay(NULL);
   if (dpy_ == nullptr)
     error_exit("Cannot connect to DISPLAY!");
@@ -247,7 +345,12 @@ GLXHeadlessContext::GLXHeadlessContext(Geometry win_size): GLContext{win_size} {
   static glXCreateContextAttribsARBProc glXCreateContextAttribsARB = NULL;
   glXCreateContextAttribsARB = (glXCreateContextAttribsARBProc) glXGetProcAddressARB( (const GLubyte *) "glXCreateContextAttribsARB" );
 
-  context_ = glXCreateContextAttribsARB(dpy_, fbc[0], 0, True, GLXcontextAttribs);
+  // Contexts on different connections to the same X server can share objects,
+  // if the driver supports it. Direct rendering contexts usually do.
+  context_ = glXCreateContextAttribsARB(dpy_, fbc[0],
+      share ? share->context_ : 0, True, GLXcontextAttribs);
+  if (context_ == nullptr)
+    error_exit("Cannot create GLX context!");
 
   pbuffer_ = glXCreatePbuffer(dpy_, fbc[0], GLXpbufferAttribs);
 
@@ -269,7 +372,8 @@ GLXHeadlessContext::~GLXHeadlessContext() {
 #endif
 
 #ifdef __APPLE__
-CGLHeadlessContext::CGLHeadlessContext(Geometry win_size): GLContext{win_size} {
+CGLHeadlessContext::CGLHeadlessContext(Geometry win_size, const CGLHeadlessContext* share):
+  GLContext{win_size, share} {
   auto checkError = [](CGLError err) {
     if (err == CGLError::kCGLNoError)
       return;
@@ -279,7 +383,7 @@ CGLHeadlessContext::CGLHeadlessContext(Geometry win_size): GLContext{win_size} {
   GLint num; // stores the number of possible pixel formats
   CGLError err = CGLChoosePixelFormat(CGLAttribs, &pix, &num);
   checkError(err);
-  err = CGLCreateContext(pix, nullptr, &context_); // second parameter can be another context for object sharing
+  err = CGLCreateContext(pix, share ? share->context_ : nullptr, &context_);
   checkError(err);
   CGLDestroyPixelFormat(pix);
   err = CGLSetCurrentContext(context_);
@@ -11,20 +11,30 @@
 #include "api.hh"
 #undef INCLUDE_GL_CONTEXT_HEADERS
 
+#include <memory>
+
 #include "lib/geometry.hh"
+#include "shareGroup.hh"
 
 namespace render {
 
 class GLContext {
   public:
-    GLContext(Geometry win_size): win_size_{win_size} {}
+    // The context shares objects with `share` if given, and starts a new share group otherwise.
+    GLContext(Geometry win_size, const GLContext* share=nullptr):
+      win_size_{win_size},
+      share_group_{share ? share->share_group_ : std::make_shared<ShareGroup>()} {}
     virtual ~GLContext() {}
 
     virtual void printInfo();
 
+    // objects shared with the other contexts of the group
+    const std::shared_ptr<ShareGroup>& share_group() const { return share_group_; }
+
   protected:
     void init();
     Geometry win_size_;
+    std::shared_ptr<ShareGroup> share_group_;
 };
 
 
@@ -44,18 +54,41 @@ class GLFWContext : public GLContext {
 // Context for EGL (server-side OpenGL on some supported GPUs)
 class EGLContext : public GLContext {
   public:
-    EGLContext(Geometry win_size, int device=0);
+    // `share` has to be on the same device
+    EGLContext(Geometry win_size, int device=0, const EGLContext* share=nullptr);
     ~EGLContext();
 
   protected:
+    // for subclasses, which call create_() with their own display
+    EGLContext(Geometry win_size, const EGLContext* share);
+    // initialize `dpy` and create the context on it
+    void create_(EGLDisplay dpy, const EGLContext* share, const EGLint* context_attribs=nullptr);
+
     EGLDisplay eglDpy_;
     ::EGLContext eglCtx_;
+    int device_ = -1;
+};
+
+// Context of Mesa's software rasterizer (llvmpipe), through EGL_MESA_platform_surfaceless.
+// Needs neither a GPU nor an X server.
+class SoftwareEGLContext : public EGLContext {
+  public:
+    // num_threads: rasterizer threads of llvmpipe, 0 for its default (one per CPU).
+    // Mesa reads it when the display is initialized, so it's set by the first
+    // software context of the process, and applies to all of them: the thread
+    // count is fixed per process.
+    // Mesa is configured through environment variables, which are set while the context
+    // is created. setenv() is not thread-safe against getenv() in other threads, so create
+    // software contexts before starting threads that read the environment (including Python
+    // threads, and SUNCGRenderAPIThread with release_host_data, see SUNCGScene).
+    SoftwareEGLContext(Geometry win_size, int num_threads=0,
+        const SoftwareEGLContext* share=nullptr);
 };
 
 // Context for GLX (OpenGL to X11)
 class GLXHeadlessContext : public GLContext {
   public:
-    GLXHeadlessContext(Geometry win_size);
+    GLXHeadlessContext(Geometry win_size, const GLXHeadlessContext* share=nullptr);
     ~GLXHeadlessContext();
 
   protected:
@@ -69,7 +102,7 @@ class GLXHeadlessContext : public GLContext {
 // Apple use CGL (Core OpenGL to initialize context)
 class CGLHeadlessContext : public GLContext {
   public:
-    CGLHeadlessContext(Geometry win_size);
+    CGLHeadlessContext(Geometry win_size, const CGLHeadlessContext* share=nullptr);
     ~CGLHeadlessContext();
 
   protected:
@@ -77,15 +110,58 @@ class CGLHeadlessContext : public GLContext {
 };
 #endif
 
-// Create a headless context, either EGLContext, GLXHeadlessContext, or CGLContext,
-// depending on OS, and DISPLAY environment variable
+// Which implementation a headless context uses
+enum class GLBackend {
+  // GLX when DISPLAY is set and device is 0, EGL otherwise.
+  // EGL is always used if environment variable HOUSE3D_FORCE_EGL=1.
+  AUTO = 0,
+  GLX = 1,            // GLXHeadlessContext. Linux only
+  EGL = 2,            // EGLContext on a GPU. Linux only
+  SOFTWARE = 3        // SoftwareEGLContext, for machines without GPUs. Linux only
+};
+
+// Create a headless context, either EGLContext, GLXHeadlessContext, SoftwareEGLContext
+// or CGLContext, depending on OS, backend and DISPLAY environment variable.
+// If `share` is given, the new context joins its share group, and is of the same kind.
+// Only EGL contexts on the same device can share objects.
+// num_threads is used by the SOFTWARE backend, see SoftwareEGLContext.
 // The caller owns the pointer.
-inline GLContext* createHeadlessContext(Geometry win_size, int device=0) {
+inline GLContext* createHeadlessContext(Geometry win_size, int device=0,
+    const GLContext* share=nullptr, GLBackend backend=GLBackend::AUTO, int num_threads=0) {
 #ifdef __APPLE__
   m_assert(device == 0);
+  if (backend != GLBackend::AUTO)
+    error_exit("Only the AUTO backend is available on Mac!");
+  if (share)
+    return new CGLHeadlessContext{win_size, dynamic_cast<const CGLHeadlessContext*>(share)};
   return new CGLHeadlessContext{win_size};
 #endif
 #ifdef __linux__
+  if (share) {
+    if (auto sw = dynamic_cast<const SoftwareEGLContext*>(share))
+      return new SoftwareEGLContext{win_size, num_threads, sw};
+    if (auto egl = dynamic_cast<const EGLContext*>(share))
+      return new EGLContext{win_size, device, egl};
+    if (auto glx = dynamic_cast<const GLXHeadlessContext*>(share)) {
+      if (device != 0)
+        error_exit("GLX contexts can only be shared on device 0!");
+      return new GLXHeadlessContext{win_size, glx};
+    }
+    error_exit("Cannot share objects with this kind of context!");
+  }
+
+  switch (backend) {
+    case GLBackend::GLX:
+      if (device != 0)
+        error_exit("GLX backend only supports device 0!");
+      return new GLXHeadlessContext{win_size};
+    case GLBackend::EGL:
+      return new EGLContext{win_size, device};
+    case GLBackend::SOFTWARE:
+      return new SoftwareEGLContext{win_size, num_threads};
+    case GLBackend::AUTO:
+      break;
+  }
 
   char* force_egl = std::getenv("HOUSE3D_FORCE_EGL");
   if (force_egl != nullptr && std::atoi(force_egl) == 1)
@@ -0,0 +1,109 @@
+// Copyright 2017-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the license found in the
+// LICENSE file in the root directory of this source tree.
+//File: pixelBuffer.hh
+
+
+#pragma once
+#include <vector>
+#include <deque>
+#include <cstring>
+#include "api.hh"
+#include "fbScope.hh"
+
+#include "lib/geometry.hh"
+#include "lib/debugutils.hh"
+#include "lib/mat.h"
+
+namespace render {
+
+// A ring of pixel buffer objects, to read framebuffers without waiting for the GPU.
+// startCapture() queues a read of a framebuffer into the next free buffer,
+// and finishCapture() waits for the oldest queued read and returns its image.
+class PixelBufferRing {
+  public:
+    PixelBufferRing(Geometry win_size, int size):
+      win_size_{win_size}, pbo_(size), fence_(size, nullptr) {
+      m_assert(size > 0);
+      glGenBuffers(size, pbo_.data());
+      for (auto pbo : pbo_) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+        glBufferData(GL_PIXEL_PACK_BUFFER, nbytes_(), nullptr, GL_STREAM_READ);
+      }
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    PixelBufferRing(const PixelBufferRing&) = delete;
+    PixelBufferRing& operator = (const PixelBufferRing&) = delete;
+
+    ~PixelBufferRing() {
+      for (auto f : fence_)
+        if (f)
+          glDeleteSync(f);
+      glDeleteBuffers(pbo_.size(), pbo_.data());
+    }
+
+    int size() const { return pbo_.size(); }
+    int pending() const { return pending_.size(); }
+    bool full() const { return pending() == size(); }
+
+    // Queue a read of the given color attachment of `fb`, which has to be bound.
+    // Returns the slot used by this capture. The ring must not be full.
+    int startCapture(const Framebuffer& fb, int attachment=0) {
+      m_assert(!full());
+      int slot = next_;
+      next_ = (next_ + 1) % size();
+
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo_[slot]);
+      fb.capture(nullptr, attachment);
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+      fence_[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      // make sure the commands are submitted, so the fence can be signaled
+      glFlush();
+      pending_.push_back(slot);
+      return slot;
+    }
+
+    // Wait for the oldest capture to finish and return it as a 3-channel image.
+    // There must be at least one pending capture.
+    Matuc finishCapture() {
+      m_assert(pending() > 0);
+      int slot = pending_.front();
+      pending_.pop_front();
+
+      GLenum ret;
+      do {
+        ret = glClientWaitSync(fence_[slot], GL_SYNC_FLUSH_COMMANDS_BIT, WAIT_TIMEOUT_NS);
+      } while (ret == GL_TIMEOUT_EXPIRED);
+      if (ret == GL_WAIT_FAILED)
+        error_exit("glClientWaitSync failed!");
+      glDeleteSync(fence_[slot]);
+      fence_[slot] = nullptr;
+
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo_[slot]);
+      auto ptr = static_cast<const unsigned char*>(
+          glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, nbytes_(), GL_MAP_READ_BIT));
+      if (ptr == nullptr)
+        error_exit("Failed to map pixel buffer!");
+      Matuc img{win_size_.h, win_size_.w, 3};
+      memcpy(img.ptr(), ptr, nbytes_());
+      glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+      return img;
+    }
+
+  private:
+    static const GLuint64 WAIT_TIMEOUT_NS = 1000000000;  // 1s
+
+    GLsizeiptr nbytes_() const { return win_size_.w * win_size_.h * 3; }
+
+    Geometry win_size_;
+    std::vector<GLuint> pbo_;
+    std::vector<GLsync> fence_;
+    std::deque<int> pending_;  // slots with a capture in flight, oldest first
+    int next_ = 0;
+};
+
+}
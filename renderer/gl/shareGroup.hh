@@ -0,0 +1,85 @@
+// Copyright 2017-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the license found in the
+// LICENSE file in the root directory of this source tree.
+//File: shareGroup.hh
+
+#pragma once
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "api.hh"
+
+namespace render {
+
+// GL objects shared by the contexts of one share group, see createHeadlessContext().
+// Buffers and textures created in one of the contexts are registered under a key, so
+// that the other contexts use them instead of uploading the same data again.
+// Container objects (VAOs and framebuffers) cannot be shared, and stay per context.
+// Methods are thread-safe.
+class ShareGroup {
+  public:
+    // The objects of a key. They are deleted with the last reference, which has to be
+    // released in a context of the group.
+    struct Objects {
+      std::vector<GLuint> buffers, textures;
+
+      Objects() {}
+      Objects(const Objects&) = delete;
+      Objects& operator = (const Objects&) = delete;
+      ~Objects() {
+        if (buffers.size())
+          glDeleteBuffers(buffers.size(), buffers.data());
+        if (textures.size())
+          glDeleteTextures(textures.size(), textures.data());
+      }
+    };
+
+    // Return the objects of `key`. If nobody holds them, make(objects) is called
+    // to create them in the current context, which has to be in this group.
+    // Other threads asking for the same key wait for it, while different keys
+    // are created concurrently.
+    std::shared_ptr<Objects> get_or_create(
+        const std::string& key, const std::function<void(Objects&)>& make) {
+      std::shared_ptr<Slot> slot;
+      {
+        std::lock_guard<std::mutex> lg(mutex_);
+        // forget the keys that nobody holds or waits for
+        for (auto itr = slots_.begin(); itr != slots_.end(); ) {
+          if (itr->second.use_count() == 1 && itr->second->objects.expired())
+            itr = slots_.erase(itr);
+          else
+            ++itr;
+        }
+        auto& s = slots_[key];
+        if (!s)
+          s = std::make_shared<Slot>();
+        slot = s;
+      }
+      std::lock_guard<std::mutex> lg(slot->mutex);
+      auto ret = slot->objects.lock();
+      if (!ret) {
+        ret = std::make_shared<Objects>();
+        make(*ret);
+        // the objects have to be complete before other contexts use them
+        glFinish();
+        slot->objects = ret;
+      }
+      return ret;
+    }
+
+  private:
+    struct Slot {
+      std::mutex mutex;
+      std::weak_ptr<Objects> objects;
+    };
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::shared_ptr<Slot>> slots_;
+};
+
+} // namespace render
@@ -11,6 +11,7 @@
 #pragma once
 #include <string>
 #include <iterator>
+#include <stdexcept>
 
 #ifdef _WIN32
 #define __attribute__(x)
@@ -38,6 +39,13 @@ void error_exit(const std::string& s) {
 	error_exit(s.c_str());
 }
 
+// For errors in the input data (e.g. a broken scene), which a long-running
+// caller may want to survive: throws std::runtime_error instead of exiting.
+inline void error_throw(const std::string& s) __attribute__((noreturn));
+void error_throw(const std::string& s) {
+	throw std::runtime_error(s);
+}
+
 // keep print_debug
 #define print_debug(fmt, ...) \
 			__print_debug__(__FILE__, __func__, __LINE__, fmt, ## __VA_ARGS__)
@@ -7,100 +7,198 @@
 
 #pragma once
 
-#include <queue>
-#include <mutex>
 #include <atomic>
-#include <future>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <thread>
-#include <iostream>
+#include <type_traits>
+#include <utility>
 #include "lib/debugutils.hh"
 
 
 namespace render {
 
 
-// Run something (rendering) in a dedicated thread
+// Run something (rendering) in a dedicated thread.
+// Jobs are passed through a fixed ring of slots, from one producer thread at a time
+// to the dedicated thread. Both sides spin for a short while before they sleep,
+// so a job costs no allocation and usually no system call.
+// Methods must not be called concurrently, nor from the jobs.
 class ExecutorInThread {
   public:
+    // at most this many jobs can be queued. execute_async() waits when the ring is full.
+    static const size_t CAPACITY = 64;
+    // jobs larger than this are allocated on the heap
+    static const size_t JOB_STORAGE_SIZE = 256;
+
     ExecutorInThread() {
       th_ = std::thread([=]() { this->work(); });
     }
 
     ~ExecutorInThread() { stop(); }
 
+    ExecutorInThread(const ExecutorInThread&) = delete;
+    ExecutorInThread& operator = (const ExecutorInThread&) = delete;
+
     // Run job in the dedicated thread and return the result.
-    template <typename T>
-    T execute_sync(std::function<T()>&& job) {
-      std::packaged_task<T()> task(job);
-      auto res = task.get_future();
-      execute_async([&task]() { task(); });
-      auto r = res.get();
-      return r;
+    // Exceptions thrown by the job are rethrown here.
+    template <typename T, typename F>
+    T execute_sync(F&& job) {
+      typename std::aligned_storage<sizeof(T), alignof(T)>::type result;
+      T* ptr = reinterpret_cast<T*>(&result);
+      std::exception_ptr error;
+      // the job and the result live on this stack until the task is done
+      run_sync_([&]() {
+            try {
+              new (ptr) T(job());
+            } catch (...) {
+              error = std::current_exception();
+            }
+          });
+      if (error)
+        std::rethrow_exception(error);
+      T ret{std::move(*ptr)};
+      ptr->~T();
+      return ret;
     }
 
-    void execute_sync(std::function<void()>&& job) {
-      std::packaged_task<void()> task(job);
-      auto res = task.get_future();
-      execute_async([&task]() { task(); });
-      res.wait();
+    template <typename F>
+    void execute_sync(F&& job) {
+      std::exception_ptr error;
+      run_sync_([&]() {
+            try {
+              job();
+            } catch (...) {
+              error = std::current_exception();
+            }
+          });
+      if (error)
+        std::rethrow_exception(error);
     }
 
     // push job to the queue for future execution in the dedicated thread
-    void execute_async(std::function<void()>&& job) {
-      std::lock_guard<std::mutex> lg(mutex_);
-      jobs_.emplace(job);
-      cv.notify_one();
+    template <typename F>
+    void execute_async(F&& job) {
+      typedef typename std::decay<F>::type Fn;
+      Job& slot = acquire_slot_();
+      store_job_<Fn>(slot, std::forward<F>(job), std::integral_constant<bool,
+          sizeof(Fn) <= JOB_STORAGE_SIZE && alignof(Fn) <= alignof(std::max_align_t)>());
+      publish_slot_();
     }
 
     void work() {
-      std::unique_lock<std::mutex> lk(mutex_, std::defer_lock);
-      while (!stopped.load()) {
-        lk.lock();
-        if (! jobs_.empty()) {
-          //print_debug("Not Empty\n");
-          auto job = jobs_.front();
-          jobs_.pop();
-          lk.unlock();
-          job();
-          //print_debug("Finsih Run Job\n");
-        } else {  // just wait on cv
-          //print_debug("Empty, watiing\n");
-          cv.wait(lk);
-          lk.unlock();
-          //print_debug("Done watining\n");
-        }
-      }
-
-      //print_debug("Clean up job queue \n");
-      std::lock_guard<std::mutex> lg(mutex_);
-      while (jobs_.size()) {
-        auto job = jobs_.front();
-        jobs_.pop();
-        job();
+      size_t head = head_.load();
+      while (true) {
+        wait_([&]() { return tail_.load() != head || stopped_.load(); }, worker_parked_);
+        if (tail_.load() == head)
+          break;    // stopped, and all the jobs are done
+        Job& job = jobs_[head % CAPACITY];
+        job.run(job.arg);
+        head_.store(++head);
+        // the producer may wait for a free slot or for a result
+        if (producer_parked_.load())
+          notify_();
       }
     }
 
     void stop() {
-      //print_debug("Stopping ...\n");
-      stopped.store(true);
-      {
-        std::lock_guard<std::mutex> lg(mutex_);
-        cv.notify_one();
-      }
+      stopped_.store(true);
+      notify_();
       if (th_.joinable())
         th_.join();
     }
 
   private:
+    struct Job {
+      void (*run)(void*);
+      void* arg;
+      typename std::aligned_storage<JOB_STORAGE_SIZE, alignof(std::max_align_t)>::type storage;
+    };
+
+    // spin this many times before sleeping. Spinning only delays the
+    // other thread when they share a single core.
+    const int spin_count_ = std::thread::hardware_concurrency() > 1 ? 2000 : 0;
+
     std::thread th_;
+    Job jobs_[CAPACITY];
+    // jobs_[head_ % CAPACITY] is the next job to run, and tail_ is the next slot to fill
+    std::atomic<size_t> head_{0}, tail_{0};
+    std::atomic_bool stopped_{false};
 
+    // a thread sleeps on cv_ only after setting its flag, and is woken up by the other
     std::mutex mutex_;
+    std::condition_variable cv_;
+    std::atomic_bool worker_parked_{false}, producer_parked_{false};
+
+    template <typename F>
+    void run_sync_(F&& task) {
+      std::atomic_bool done{false};
+      execute_async([&]() {
+            task();
+            done.store(true);
+          });
+      wait_([&]() { return done.load(); }, producer_parked_);
+    }
 
-    std::atomic_bool stopped{false};
+    // construct the job in the slot
+    template <typename Fn, typename F>
+    static void store_job_(Job& slot, F&& job, std::true_type) {
+      new (&slot.storage) Fn(std::forward<F>(job));
+      slot.arg = &slot.storage;
+      slot.run = [](void* p) {
+        Fn* fn = static_cast<Fn*>(p);
+        (*fn)();
+        fn->~Fn();
+      };
+    }
 
-    std::condition_variable cv;
-    std::queue<std::function<void()>> jobs_;
+    // the job doesn't fit into the slot
+    template <typename Fn, typename F>
+    static void store_job_(Job& slot, F&& job, std::false_type) {
+      slot.arg = new Fn(std::forward<F>(job));
+      slot.run = [](void* p) {
+        std::unique_ptr<Fn> fn{static_cast<Fn*>(p)};
+        (*fn)();
+      };
+    }
 
+    Job& acquire_slot_() {
+      size_t tail = tail_.load();
+      wait_([&]() { return tail - head_.load() < CAPACITY; }, producer_parked_);
+      return jobs_[tail % CAPACITY];
+    }
+
+    void publish_slot_() {
+      tail_.store(tail_.load() + 1);
+      if (worker_parked_.load())
+        notify_();
+    }
+
+    // Wait until ready() is true: spin first, then sleep with `parked` set.
+    // All the atomics are sequentially consistent, so either ready() sees the change,
+    // or the other thread sees `parked` and wakes this one up.
+    template <typename Pred>
+    void wait_(Pred&& ready, std::atomic_bool& parked) {
+      for (int i = 0; i < spin_count_; ++i)
+        if (ready())
+          return;
+      std::unique_lock<std::mutex> lk(mutex_);
+      parked.store(true);
+      while (!ready())
+        cv_.wait(lk);
+      parked.store(false);
+    }
+
+    void notify_() {
+      // The sleeping thread holds the mutex from setting its flag until it sleeps.
+      // Notify after unlocking, so that it doesn't wake up only to wait for the mutex.
+      { std::lock_guard<std::mutex> lg(mutex_); }
+      cv_.notify_all();
+    }
 };
 
 
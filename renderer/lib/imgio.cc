@@ -23,7 +23,7 @@ using namespace std;
 
 Matuc read_img(const char* fname) {
 	if (! exists_file(fname))
-		error_exit(ssprintf("File \"%s\" not exists!", fname));
+		error_throw(ssprintf("File \"%s\" not exists!", fname));
 	CImg<unsigned char> img(fname);
   int channel = img.spectrum();
 	m_assert(channel == 3 || channel == 1 || channel == 4);
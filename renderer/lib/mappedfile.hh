@@ -0,0 +1,66 @@
+// Copyright 2017-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the license found in the
+// LICENSE file in the root directory of this source tree.
+//File: mappedfile.hh
+
+#pragma once
+
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "debugutils.hh"
+#include "strutils.hh"
+
+// A read-only memory mapping of a whole file.
+class MappedFile {
+  public:
+    explicit MappedFile(const std::string& fname) {
+      int fd = open(fname.c_str(), O_RDONLY);
+      if (fd < 0)
+        error_throw(ssprintf("Cannot open %s!", fname.c_str()));
+      struct stat st;
+      if (fstat(fd, &st) != 0) {
+        close(fd);
+        error_throw(ssprintf("Cannot stat %s!", fname.c_str()));
+      }
+      size_ = st.st_size;
+      void* ptr = size_ > 0 ? mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+      // the mapping stays valid after the file is closed
+      close(fd);
+      if (ptr == MAP_FAILED)
+        error_throw(ssprintf("Cannot mmap %s!", fname.c_str()));
+      data_ = static_cast<const char*>(ptr);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator = (const MappedFile&) = delete;
+
+    ~MappedFile() {
+      if (data_)
+        munmap(const_cast<char*>(data_), size_);
+    }
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+  private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Whether file `a` exists and is modified after file `b`, e.g. whether a cache is newer
+// than its source. The times are compared in nanoseconds: a file written in the same
+// second as its source is not considered newer unless its time is strictly greater.
+inline bool is_newer_file(const std::string& a, const std::string& b) {
+  struct stat sa, sb;
+  if (stat(a.c_str(), &sa) != 0 || stat(b.c_str(), &sb) != 0)
+    return false;
+  if (sa.st_mtim.tv_sec != sb.st_mtim.tv_sec)
+    return sa.st_mtim.tv_sec > sb.st_mtim.tv_sec;
+  return sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec;
+}
@@ -9,33 +9,146 @@
 #include "mesh.hh"
 #include "gl/utils.hh"
 
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
 using namespace std;
 
 namespace render {
 
+namespace {
+
+// IEEE half float, rounded to nearest
+GLushort toHalf(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  uint32_t sign = (x >> 16) & 0x8000;
+  int exp = ((x >> 23) & 0xff) - 127 + 15;
+  uint32_t mant = x & 0x7fffff;
+  if (((x >> 23) & 0xff) == 0xff)   // inf or nan
+    return sign | 0x7c00 | (mant ? 0x200 : 0);
+  if (exp >= 31)    // overflow
+    return sign | 0x7c00;
+  if (exp <= 0) {   // subnormal or zero
+    if (exp < -10)
+      return sign;
+    mant |= 0x800000;
+    int shift = 14 - exp;
+    return sign | ((mant + (1u << (shift - 1))) >> shift);
+  }
+  // rounding may carry into the exponent, which is still correct
+  return sign | ((exp << 10) + ((mant + 0x1000) >> 13));
+}
+
+// a unit vector as signed normalized GL_INT_2_10_10_10_REV
+GLuint packNormal(const glm::vec3& n) {
+  auto pack = [](float v) -> GLuint {
+    int k = static_cast<int>(std::round(glm::clamp(v, -1.f, 1.f) * 511.f));
+    return static_cast<GLuint>(k) & 0x3ff;
+  };
+  return pack(n.x) | (pack(n.y) << 10) | (pack(n.z) << 20);
+}
+
+struct CompactVertex {
+  glm::vec3 pos;
+  GLuint normal;
+  GLushort texcoord[2];
+};
+
+struct CompactVertexNoTexcoord {
+  glm::vec3 pos;
+  GLuint normal;
+};
+
+// bytes of a vertex in the given format. Position is a vec3 at offset 0 in all of them.
+size_t vertexSize(VertexFormat format) {
+  switch (format) {
+    case VertexFormat::COMPACT: return sizeof(CompactVertex);
+    case VertexFormat::COMPACT_NO_TEXCOORD: return sizeof(CompactVertexNoTexcoord);
+    default: return sizeof(Vertex);
+  }
+}
+
+// Upload vertices in the given format to the bound GL_ARRAY_BUFFER
+void uploadVertices(const Vertex* vertices, size_t num, VertexFormat format) {
+  if (format == VertexFormat::FLOAT) {
+    // A great thing about structs is that their memory layout is sequential for all its items.
+    // The effect is that we can simply pass a pointer to the struct and it translates perfectly to a glm::vec3/2 array which
+    // again translates to 3/2 floats which translates to a byte array.
+    glBufferData(GL_ARRAY_BUFFER, num * sizeof(Vertex), vertices, GL_STATIC_DRAW);
+  } else if (format == VertexFormat::COMPACT) {
+    vector<CompactVertex> buf(num);
+    for (size_t i = 0; i < num; ++i) {
+      buf[i].pos = vertices[i].pos;
+      buf[i].normal = packNormal(vertices[i].normal);
+      buf[i].texcoord[0] = toHalf(vertices[i].texcoord.x);
+      buf[i].texcoord[1] = toHalf(vertices[i].texcoord.y);
+    }
+    glBufferData(GL_ARRAY_BUFFER, num * sizeof(CompactVertex), buf.data(), GL_STATIC_DRAW);
+  } else {
+    vector<CompactVertexNoTexcoord> buf(num);
+    for (size_t i = 0; i < num; ++i) {
+      buf[i].pos = vertices[i].pos;
+      buf[i].normal = packNormal(vertices[i].normal);
+    }
+    glBufferData(GL_ARRAY_BUFFER, num * sizeof(CompactVertexNoTexcoord), buf.data(), GL_STATIC_DRAW);
+  }
+}
+
+// Setup the attributes of the bound VAO, for vertices of the given format
+// in the bound GL_ARRAY_BUFFER
+void setupAttributes(VertexFormat format) {
+  switch (format) {
+    case VertexFormat::FLOAT:
+      // Vertex Positions
+      glEnableVertexAttribArray(0);
+      glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)0);
+      // Vertex Normals
+      glEnableVertexAttribArray(1);
+      glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, normal));
+      // Vertex Texture Coords
+      glEnableVertexAttribArray(2);
+      glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, texcoord));
+      break;
+    case VertexFormat::COMPACT:
+      glEnableVertexAttribArray(0);
+      glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(CompactVertex), (GLvoid*)0);
+      glEnableVertexAttribArray(1);
+      glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, sizeof(CompactVertex),
+          (GLvoid*)offsetof(CompactVertex, normal));
+      glEnableVertexAttribArray(2);
+      glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(CompactVertex),
+          (GLvoid*)offsetof(CompactVertex, texcoord));
+      break;
+    case VertexFormat::COMPACT_NO_TEXCOORD:
+      glEnableVertexAttribArray(0);
+      glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(CompactVertexNoTexcoord), (GLvoid*)0);
+      glEnableVertexAttribArray(1);
+      glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, sizeof(CompactVertexNoTexcoord),
+          (GLvoid*)offsetof(CompactVertexNoTexcoord, normal));
+      // texcoord is the constant (0, 0)
+      glDisableVertexAttribArray(2);
+      break;
+  }
+}
+
+}
+
 void Mesh::activate() {
   glGenVertexArrays(1, VAO);
   glGenBuffers(1, VBO);
+  glGenBuffers(1, EBO);
+  // no more vertices will be added
+  dedup_.clear();
 
   VertexArrayGuard VAG{VAO};
   // Load data into vertex buffers
   glBindBuffer(GL_ARRAY_BUFFER, VBO);
-  // A great thing about structs is that their memory layout is sequential for all its items.
-  // The effect is that we can simply pass a pointer to the struct and it translates perfectly to a glm::vec3/2 array which
-  // again translates to 3/2 floats which translates to a byte array.
-  glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex),
-      vertices.data(), GL_STATIC_DRAW);
-
-  // Set the vertex attribute pointers
-  // Vertex Positions
-  glEnableVertexAttribArray(0);
-  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)0);
-  // Vertex Normals
-  glEnableVertexAttribArray(1);
-  glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, normal));
-  // Vertex Texture Coords
-  glEnableVertexAttribArray(2);
-  glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, texcoord));
+  uploadVertices(vertices.data(), vertices.size(), format_);
+  setupAttributes(format_);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
 }
 
 void Mesh::deactivate() {
@@ -43,12 +156,120 @@ void Mesh::deactivate() {
     glDeleteVertexArrays(1, VAO);
   if (VBO)
     glDeleteBuffers(1, VBO);
+  if (EBO)
+    glDeleteBuffers(1, EBO);
 }
 
 void Mesh::draw() {
   VertexArrayGuard VAG{VAO};
-  glDrawArrays(GL_TRIANGLES, 0, vertices.size());
-  glCheckError("Mesh::draw::glDrawArrays");
+  glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);
+  glCheckError("Mesh::draw::glDrawElements");
+}
+
+void MergedMesh::DrawBatch::add(const MergedMesh& mesh, int i) {
+  if (!first.empty() && first.back() + count.back() == mesh.first[i]) {
+    count.back() += mesh.count[i];
+  } else {
+    first.push_back(mesh.first[i]);
+    count.push_back(mesh.count[i]);
+    offset.push_back(reinterpret_cast<const GLvoid*>(mesh.first[i] * sizeof(GLuint)));
+  }
+}
+
+void MergedMesh::finish_mesh() {
+  GLint start = first.empty() ? 0 : first.back() + count.back();
+  first.push_back(start);
+  count.push_back(num_indices() - start);
+  // vertices are only shared inside a mesh
+  dedup_.clear();
+}
+
+void MergedMesh::upload_buffers_(GLuint vbo, GLuint ebo) {
+  if (!has_host_data() && host_data_loader_)
+    host_data_loader_();
+  m_assert(has_host_data());
+  glBindBuffer(GL_ARRAY_BUFFER, vbo);
+  uploadVertices(vertex_data(), num_vertices(), format_);
+
+  // no VAO is bound, so the indices are uploaded through GL_ARRAY_BUFFER
+  glBindBuffer(GL_ARRAY_BUFFER, ebo);
+  glBufferData(GL_ARRAY_BUFFER, num_indices() * sizeof(GLuint), index_data(), GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void MergedMesh::activate() {
+  if (share_group_) {
+    // uploaded by the first context of the group that activates the same mesh
+    shared_buffers_ = share_group_->get_or_create(share_key_,
+        [this](ShareGroup::Objects& objs) {
+          objs.buffers.resize(2);
+          glGenBuffers(2, objs.buffers.data());
+          upload_buffers_(objs.buffers[0], objs.buffers[1]);
+        });
+    VBO.obj = shared_buffers_->buffers[0];
+    EBO.obj = shared_buffers_->buffers[1];
+  } else {
+    glGenBuffers(1, VBO);
+    glGenBuffers(1, EBO);
+    upload_buffers_(VBO, EBO);
+  }
+
+  glGenVertexArrays(1, VAO);
+  {
+    VertexArrayGuard VAG{VAO};
+    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+    setupAttributes(format_);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+  }
+
+  glGenVertexArrays(1, posVAO);
+  VertexArrayGuard VAG{posVAO};
+  glBindBuffer(GL_ARRAY_BUFFER, VBO);
+  glEnableVertexAttribArray(0);
+  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, vertexSize(format_), (GLvoid*)0);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+}
+
+void MergedMesh::deactivate() {
+  if (VAO) {
+    glDeleteVertexArrays(1, VAO);
+    VAO.obj = 0;
+  }
+  if (posVAO) {
+    glDeleteVertexArrays(1, posVAO);
+    posVAO.obj = 0;
+  }
+  if (shared_buffers_) {
+    // deleted by the group when no context uses them
+    shared_buffers_.reset();
+    VBO.obj = EBO.obj = 0;
+    return;
+  }
+  if (VBO) {
+    glDeleteBuffers(1, VBO);
+    VBO.obj = 0;
+  }
+  if (EBO) {
+    glDeleteBuffers(1, EBO);
+    EBO.obj = 0;
+  }
+}
+
+size_t MergedMesh::gpu_bytes() const {
+  return num_vertices() * vertexSize(format_) + num_indices() * sizeof(GLuint);
+}
+
+void MergedMesh::draw(bool position_only) {
+  VertexArrayGuard VAG{position_only ? posVAO : VAO};
+  glDrawElements(GL_TRIANGLES, num_indices(), GL_UNSIGNED_INT, 0);
+  glCheckError("MergedMesh::draw::glDrawElements");
+}
+
+void MergedMesh::draw(const DrawBatch& batch, bool position_only) {
+  VertexArrayGuard VAG{position_only ? posVAO : VAO};
+  glMultiDrawElements(GL_TRIANGLES, batch.count.data(), GL_UNSIGNED_INT,
+      batch.offset.data(), batch.size());
+  glCheckError("MergedMesh::draw::glMultiDrawElements");
 }
 
 }
@@ -8,16 +8,57 @@
 #pragma once
 #include <vector>
 #include <array>
+#include <functional>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
 
 #include "gl/geometry.hh"
+#include "gl/shareGroup.hh"
 #include "gl/utils.hh"
+#include "lib/debugutils.hh"
 
 namespace render {
 
-// Mesh is a bunch of vertices (usaully triangles)
+// Index of the distinct vertices added to a vertex array
+class VertexDedup {
+  public:
+    // Returns the index of v in `vertices`, and appends it if it's new.
+    GLuint add(std::vector<Vertex>& vertices, const Vertex& v) {
+      auto itr = index_.emplace(v, vertices.size());
+      if (itr.second)
+        vertices.push_back(v);
+      return itr.first->second;
+    }
+
+    // forget all vertices and release the memory
+    void clear() { decltype(index_)().swap(index_); }
+
+  private:
+    struct Hash {
+      size_t operator()(const Vertex& v) const {
+        const uint32_t* p = reinterpret_cast<const uint32_t*>(&v);
+        size_t h = 0;
+        for (size_t i = 0; i < sizeof(Vertex) / sizeof(uint32_t); ++i)
+          h = h * 1000003 ^ p[i];
+        return h;
+      }
+    };
+    struct Equal {
+      bool operator()(const Vertex& a, const Vertex& b) const {
+        return memcmp(&a, &b, sizeof(Vertex)) == 0;
+      }
+    };
+    std::unordered_map<Vertex, GLuint, Hash, Equal> index_;
+};
+
+// Mesh is a bunch of indexed vertices (usaully triangles)
 class Mesh {
   public:
     std::vector<Vertex> vertices;
+    std::vector<GLuint> indices;
 
     Mesh() {}
     Mesh(const Mesh&) = delete;
@@ -26,12 +67,150 @@ class Mesh {
 
     ~Mesh() { deactivate(); }
 
+    // add a vertex of the next triangle. Identical vertices are stored once.
+    void add_vertex(const Vertex& v) { indices.push_back(dedup_.add(vertices, v)); }
+
+    // format of the vertices on GPU, used by the next activate()
+    void set_vertex_format(VertexFormat f) { format_ = f; }
+
     // setup GL buffers for rendering
     void activate();
     void deactivate();
     void draw();
   protected:
-    GLIntResource<GLuint> VAO, VBO;
+    GLIntResource<GLuint> VAO, VBO, EBO;
+    VertexDedup dedup_;
+    VertexFormat format_ = VertexFormat::FLOAT;
+};
+
+// Many indexed meshes packed into a single vertex buffer and element buffer.
+// Mesh i is indices[first[i], first[i] + count[i]), so that
+// any subset of the meshes can be drawn with one glMultiDrawElements.
+class MergedMesh {
+  public:
+    std::vector<Vertex> vertices;
+    std::vector<GLuint> indices;
+    std::vector<GLint> first;
+    std::vector<GLsizei> count;
+
+    // A subset of the meshes to be drawn together
+    struct DrawBatch {
+      std::vector<GLint> first;
+      std::vector<GLsizei> count;
+      // byte offsets of `first` in the element buffer
+      std::vector<const GLvoid*> offset;
+
+      // add the i-th mesh of `mesh`. It is merged to the previous range if they are adjacent.
+      void add(const MergedMesh& mesh, int i);
+      int size() const { return first.size(); }
+    };
+
+    MergedMesh() {}
+    MergedMesh(const MergedMesh&) = delete;
+    MergedMesh& operator = (const MergedMesh&) = delete;
+    MergedMesh(MergedMesh&&) = default;
+
+    ~MergedMesh() { deactivate(); }
+
+    // add a vertex of the next triangle of the current mesh.
+    // Identical vertices in a mesh are stored once.
+    void add_vertex(const Vertex& v) { indices.push_back(dedup_.add(vertices, v)); }
+    // Finish the current mesh: vertices added after the previous call belong to it.
+    void finish_mesh();
+    int size() const { return first.size(); }
+
+    // format of the vertices on GPU, used by the next activate()
+    void set_vertex_format(VertexFormat f) { format_ = f; }
+    VertexFormat vertex_format() const { return format_; }
+
+    // Use vertices and indices owned by someone else (e.g. a memory-mapped file),
+    // instead of `vertices` and `indices`. The memory has to outlive the mesh.
+    void set_external_data(const Vertex* vertices, size_t num_vertices,
+        const GLuint* indices, size_t num_indices) {
+      m_assert(this->vertices.empty() && this->indices.empty());
+      external_ = true;
+      external_vertices_ = vertices;
+      num_external_vertices_ = num_vertices;
+      external_indices_ = indices;
+      num_external_indices_ = num_indices;
+    }
+    const Vertex* vertex_data() const {
+      return external_ ? external_vertices_ : vertices.data();
+    }
+    size_t num_vertices() const {
+      return external_ ? num_external_vertices_ : vertices.size();
+    }
+    const GLuint* index_data() const {
+      return external_ ? external_indices_ : indices.data();
+    }
+    size_t num_indices() const {
+      return external_ ? num_external_indices_ : indices.size();
+    }
+
+    // Free `vertices` and `indices` and forget the external data, e.g. after activate().
+    // The sizes are kept, so the activated mesh can still be drawn.
+    // set_external_data() has to be called before the next activate().
+    void release_host_data() {
+      if (!external_) {
+        num_external_vertices_ = vertices.size();
+        num_external_indices_ = indices.size();
+        decltype(vertices)().swap(vertices);
+        decltype(indices)().swap(indices);
+        external_ = true;
+      }
+      external_vertices_ = nullptr;
+      external_indices_ = nullptr;
+    }
+    bool has_host_data() const {
+      return !external_ || external_vertices_ != nullptr;
+    }
+    // Called by activate() to bring back the released host data when the buffers have
+    // to be uploaded, i.e. not when they are taken from the share group.
+    void set_host_data_loader(std::function<void()> loader) {
+      host_data_loader_ = std::move(loader);
+    }
+
+    // Share the GL buffers with the meshes of the same key in other contexts of the group,
+    // which need the same vertices, indices and vertex format.
+    // The next activate() only uploads the mesh if no context of the group has it.
+    void set_share_group(std::shared_ptr<ShareGroup> group, std::string key) {
+      share_group_ = std::move(group);
+      share_key_ = std::move(key);
+    }
+
+    // setup GL buffers for rendering
+    void activate();
+    void deactivate();
+    // bytes of the GL buffers created by activate(), including the shared ones
+    size_t gpu_bytes() const;
+    // bytes of `vertices` and `indices` owned by the mesh
+    size_t host_bytes() const {
+      return vertices.capacity() * sizeof(Vertex) + indices.capacity() * sizeof(GLuint);
+    }
+    // Draw all meshes. With position_only, only vertex attribute 0 (position)
+    // is enabled, so the other attributes are not fetched.
+    void draw(bool position_only=false);
+    void draw(const DrawBatch& batch, bool position_only=false);
+  protected:
+    GLIntResource<GLuint> VAO, VBO, EBO;
+    // for position_only drawing. Shares VBO and EBO with VAO
+    GLIntResource<GLuint> posVAO;
+    VertexDedup dedup_;
+    VertexFormat format_ = VertexFormat::FLOAT;
+    std::shared_ptr<ShareGroup> share_group_;
+    std::string share_key_;
+    // VBO and EBO, if they are shared
+    std::shared_ptr<ShareGroup::Objects> shared_buffers_;
+    std::function<void()> host_data_loader_;
+    // whether the data is in external_vertices_ and external_indices_
+    bool external_ = false;
+    const Vertex* external_vertices_ = nullptr;
+    size_t num_external_vertices_ = 0;
+    const GLuint* external_indices_ = nullptr;
+    size_t num_external_indices_ = 0;
+
+    // upload the vertices and indices to the buffers, loading them first if released
+    void upload_buffers_(GLuint vbo, GLuint ebo);
 };
 
 } // namespace render
@@ -6,18 +6,21 @@
 //File: obj.cc
 
 #include "obj.hh"
+#include "objparser.hh"
+#include "texturestore.hh"
 
 #include <iostream>
 #include <algorithm>
 #include <unordered_map>
 #include <unordered_set>
+#include <atomic>
+#include <thread>
 #include <glm/gtc/type_ptr.hpp>
 
 #include "lib/debugutils.hh"
 #include "lib/strutils.hh"
 #include "lib/utils.hh"
 #include "lib/timer.hh"
-#include "lib/imgproc.hh"
 
 using namespace std;
 
@@ -44,9 +47,9 @@ bool ObjLoader::load(string fname) {
 
   string err;
   vector<tinyobj::shape_t> tmp_shapes;
-  bool ret = tinyobj::LoadObj(&attrib, &tmp_shapes, &materials, &err, fname.c_str(), base_dir.c_str());
+  bool ret = parallelLoadObj(&attrib, &tmp_shapes, &materials, &err, fname, base_dir);
   if (not ret)
-    error_exit(err);
+    error_throw(err);
   // if (not err.empty()) {
   //   cerr << "Warnings from tinyobj:" << endl;
   //   cerr << err << endl;
@@ -66,10 +69,10 @@ bool ObjLoader::load(string fname) {
     for (auto& id : shp.mesh.material_ids) {
       // This can happen if, e.g., the mtl file cannot be found
       if (id < 0) {
-        error_exit("Materials are not loaded correctly.");
+        error_throw("Materials are not loaded correctly.");
       }
       if (id >= num_material) {
-        error_exit(ssprintf("Need material %d but only %d materials were loaded.", id, num_material));
+        error_throw(ssprintf("Need material %d but only %d materials were loaded.", id, num_material));
       }
     }
   }
@@ -168,22 +171,21 @@ void ObjLoader::split_shapes_by_material() {
   std::swap(shapes, new_shapes);
 }
 
-void ObjLoader::sort_by_transparent(const TextureRegistry& tex) {
-  auto is_transparent_material = [this,&tex](int matid) {
-     auto& m = this->materials[matid];
-     if (m.dissolve < 1.0)
-       return true;
-     if (m.diffuse_texname.empty())
-       return false;
-     return tex.is_transparent(m.diffuse_texname);
-  };
-
+bool ObjLoader::is_transparent_material(int matid, const TextureRegistry& tex) const {
+  auto& m = materials[matid];
+  if (m.dissolve < 1.0)
+    return true;
+  if (m.diffuse_texname.empty())
+    return false;
+  return tex.is_transparent(m.diffuse_texname);
+}
 
+void ObjLoader::sort_by_transparent(const TextureRegistry& tex) {
   // Get the sorted indices for the shapes
   std::sort(shapes.begin(), shapes.end(),
-      [this, &is_transparent_material](const Shape& a, const Shape& b) -> bool {
-        bool is_a = is_transparent_material(a.mesh.material_ids[0]),
-          is_b = is_transparent_material(b.mesh.material_ids[0]);
+      [this, &tex](const Shape& a, const Shape& b) -> bool {
+        bool is_a = is_transparent_material(a.mesh.material_ids[0], tex),
+          is_b = is_transparent_material(b.mesh.material_ids[0], tex);
         if (is_a != is_b)
           return is_b;
         return a.name.compare(b.name) < 0;
@@ -192,64 +194,209 @@ void ObjLoader::sort_by_transparent(const TextureRegistry& tex) {
 
 TextureRegistry::TextureRegistry(
     const vector<tinyobj::material_t>& materials,
-    string base_dir): base_dir_(base_dir) {
+    string base_dir, bool use_texture_array, int max_texture_size):
+  use_texture_array_(use_texture_array), max_texture_size_(max_texture_size),
+  base_dir_(base_dir) {
+  unordered_set<string> seen;
   for (size_t i = 0; i < materials.size(); i++) {
     auto& m = materials[i];
     string texname = m.diffuse_texname;
     if (texname.empty()) continue;
-    if (get(texname) == 0)
-      loadTexture(texname);
+    if (seen.insert(texname).second) {
+      string filename = squeeze_path(texname);
+      if (!exists_file(texname.c_str())) {
+        // Append base dir.
+        filename = squeeze_path(base_dir_ + texname);
+        if (!exists_file(filename.c_str()))
+          error_throw(ssprintf("Cannot find texture %s\n", texname.c_str()));
+      }
+      texnames_.emplace_back(texname);
+      filenames_.emplace_back(filename);
+    }
 
     if (m.specular_texname.length() or m.normal_texname.length()
         or m.specular_highlight_texname.length() or m.ambient_texname.length()) {
       print_debug("Material %s has unsupported texture!\n", m.name.c_str());
     }
   }
+  if (texnames_.size())
+    loading_ = std::async(std::launch::async, [this]() {
+        this->loadTextures();
+      }).share();
 }
 
 
-void TextureRegistry::loadTexture(const string& texname) {
-  string filename = squeeze_path(texname);
-  if (!exists_file(texname.c_str())) {
-    // Append base dir.
-    filename = squeeze_path(base_dir_ + texname);
-    if (!exists_file(filename.c_str()))
-      error_exit(ssprintf("Cannot find texture %s\n", texname.c_str()));
+vector<shared_ptr<const Matuc>> TextureRegistry::decodeTextures() const {
+  vector<shared_ptr<const Matuc>> images(filenames_.size());
+  atomic<size_t> next{0};
+  auto work = [&]() {
+    size_t i;
+    while ((i = next++) < images.size()) {
+      images[i] = TextureStore::get(filenames_[i], max_texture_size_);
+    }
+  };
+  size_t num_threads = std::min<size_t>(
+      std::max(thread::hardware_concurrency(), 1u), images.size());
+  vector<thread> pool;
+  for (size_t i = 1; i < num_threads; ++i)
+    pool.emplace_back(work);
+  work();
+  for (auto& th : pool)
+    th.join();
+  return images;
+}
+
+void TextureRegistry::loadTextures() {
+  auto images = decodeTextures();
+  // layouts are assigned in the order of materials, independent of the decoding
+  for (size_t i = 0; i < images.size(); ++i) {
+    auto& image = *images[i];
+    m_assert(image.channels() >= 3);
+    if (use_texture_array_) {
+      auto size = make_pair(image.width(), image.height());
+      auto itr = array_index_.find(size);
+      if (itr == array_index_.end()) {
+        itr = array_index_.emplace(size, array_shape_.size()).first;
+        array_shape_.push_back({{image.width(), image.height(), 0}});
+      }
+      int idx = itr->second;
+      layers_[texnames_[i]] = Layer{idx, array_shape_[idx][2]++};
+    }
+    if (image.channels() == 4)
+      transparent_.insert(texnames_[i]);
+    image_bytes_ += image.elements();
+    texture_images_[texnames_[i]] = std::move(images[i]);
   }
+}
 
-  Matuc image = read_img(filename.c_str());
-  vflip(image);
-  m_assert(image.channels() >= 3);
-  texture_images_[texname] = std::move(image);
+void TextureRegistry::activateArrays() {
+  for (auto& shape : array_shape_) {
+    GLuint tid;
+    glGenTextures(1, &tid);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, tid);
+    // GL_LINEAR minification only samples level 0, so no mipmaps are needed.
+    // Textures are downscaled on decode instead.
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+    // RGB textures are stored with alpha = 1
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA, shape[0], shape[1], shape[2],
+        0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    arrays_.push_back(tid);
+  }
+  for (auto& itr : texture_images_) {
+    auto& image = *itr.second;
+    Layer layer = layers_.at(itr.first);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, arrays_[layer.array]);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer.layer,
+        image.width(), image.height(), 1,
+        image.channels() == 3 ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, image.ptr());
+  }
+  glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
 }
 
 void TextureRegistry::activate() {
   m_assert(!activated_);
+  wait_();
+  if (share_group_) {
+    // uploaded by the first context of the group that activates the same textures
+    shared_textures_ = share_group_->get_or_create(share_key_,
+        [this](ShareGroup::Objects& objs) {
+          upload_();
+          if (use_texture_array_)
+            objs.textures = arrays_;
+          else
+            for (auto& name : texnames_)
+              objs.textures.push_back(map_.at(name));
+        });
+    auto& textures = shared_textures_->textures;
+    if (use_texture_array_) {
+      arrays_ = textures;
+    } else {
+      for (size_t i = 0; i < texnames_.size(); ++i)
+        map_[texnames_[i]] = textures[i];
+    }
+  } else {
+    upload_();
+  }
+  activated_ = true;
+}
+
+void TextureRegistry::upload_() {
+  if (images_released_) {
+    // same files and sizes, so the layout doesn't change
+    auto images = decodeTextures();
+    for (size_t i = 0; i < images.size(); ++i)
+      texture_images_[texnames_[i]] = std::move(images[i]);
+    images_released_ = false;
+  }
   //TotalTimer tmmm("loadTexture::activate");
+  // rows of the images are tightly packed, and 3-channel rows of odd width
+  // (e.g. after downscaling) are not a multiple of the default alignment of 4
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  if (use_texture_array_) {
+    activateArrays();
+    return;
+  }
 
   for (auto& itr : texture_images_) {
-    auto& image = itr.second;
+    auto& image = *itr.second;
     GLuint tid;
     glGenTextures(1, &tid);
     glBindTexture(GL_TEXTURE_2D, tid);
+    // GL_LINEAR minification only samples level 0, so no mipmaps are needed.
+    // Textures are downscaled on decode instead.
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
     if (image.channels() == 3)
       glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, image.width(), image.height(), 0, GL_RGB, GL_UNSIGNED_BYTE, image.ptr());
     else
       glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image.width(), image.height(), 0, GL_RGBA, GL_UNSIGNED_BYTE, image.ptr());
-    glGenerateMipmap(GL_TEXTURE_2D);
     glBindTexture(GL_TEXTURE_2D, 0);
     map_[itr.first] = tid;
   }
-  activated_ = true;
+}
+
+void TextureRegistry::release_host_data() {
+  wait_();
+  texture_images_.clear();
+  images_released_ = true;
+}
+
+size_t TextureRegistry::gpu_bytes() const {
+  wait_();
+  size_t ret = 0;
+  if (use_texture_array_) {
+    // arrays are always RGBA
+    for (auto& shape : array_shape_)
+      ret += size_t(shape[0]) * shape[1] * shape[2] * 4;
+  } else {
+    ret = image_bytes_;
+  }
+  return ret;
+}
+
+size_t TextureRegistry::host_bytes() const {
+  wait_();
+  return images_released_ ? 0 : image_bytes_;
 }
 
 void TextureRegistry::deactivate() {
   activated_ = false;
+  if (shared_textures_) {
+    // deleted by the group when no context uses them
+    shared_textures_.reset();
+    map_.clear();
+    arrays_.clear();
+    return;
+  }
   for (auto& item: map_)
     glDeleteTextures(1, &item.second);
   map_.clear();
+  if (arrays_.size())
+    glDeleteTextures(arrays_.size(), arrays_.data());
+  arrays_.clear();
 }
 
 
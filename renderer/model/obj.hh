@@ -8,12 +8,18 @@
 #pragma once
 
 #include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <future>
+#include <memory>
+#include <array>
 #include <vector>
 #include "gl/api.hh"
 #include <tiny_obj_loader.h>
 
 #include "lib/mat.h"
 #include "gl/geometry.hh"
+#include "gl/shareGroup.hh"
 
 namespace render {
 
@@ -44,6 +50,8 @@ class ObjLoader {
     int original_num_shapes;
 
     ObjLoader(std::string fname) { load(fname); }
+    // an empty loader, to be filled by the caller
+    ObjLoader(): original_num_shapes{0} {}
 
     void printInfo() const;
 
@@ -55,6 +63,9 @@ class ObjLoader {
     // sort shapes by transparency. Put opaque objects first.
     void sort_by_transparent(const TextureRegistry& tex);
 
+    // whether the material may have transparent pixels
+    bool is_transparent_material(int matid, const TextureRegistry& tex) const;
+
   private:
     bool load(std::string fname);
 
@@ -64,14 +75,22 @@ class ObjLoader {
 // maintain mapping from texture name to registered OpenGL texture id
 class TextureRegistry {
   public:
+    // With use_texture_array, textures of the same size are packed into
+    // layers of one GL_TEXTURE_2D_ARRAY, and have to be looked up by
+    // get_layer() instead of get().
+    // Textures are decoded by a pool of threads in the background. Queries and
+    // activate() wait for the decoding to finish.
+    // Textures larger than max_texture_size are downscaled, see TextureStore::get().
     TextureRegistry(
         const std::vector<tinyobj::material_t>& materials,
-        std::string base_dir);
+        std::string base_dir, bool use_texture_array=false,
+        int max_texture_size=0);
 
     TextureRegistry(const TextureRegistry&) = delete;
     TextureRegistry& operator = (const TextureRegistry&) = delete;
-    TextureRegistry(TextureRegistry&&) = default;
-    ~TextureRegistry() { deactivate(); }
+    // the decoding threads refer to this object
+    TextureRegistry(TextureRegistry&&) = delete;
+    ~TextureRegistry() { wait_(); deactivate(); }
 
     GLuint get(std::string texname) const {
       auto itr = map_.find(texname);
@@ -79,26 +98,94 @@ class TextureRegistry {
       return itr->second;
     }
 
+    // Location of a texture in the texture arrays
+    struct Layer {
+      int array;  // index of the array, or -1 if there is no such texture
+      int layer;
+    };
+
+    // Available without activate(), so the layout can be used to sort draws.
+    Layer get_layer(std::string texname) const {
+      wait_();
+      auto itr = layers_.find(texname);
+      if (itr == layers_.end()) return Layer{-1, 0};
+      return itr->second;
+    }
+
+    // OpenGL texture id of the i-th texture array
+    GLuint get_array(int i) const { return arrays_.at(i); }
+
     bool is_transparent(std::string texname) const {
-      auto itr = texture_images_.find(texname);
-      if (itr == texture_images_.end()) return false;
-      return itr->second.channels() == 4;
+      wait_();
+      return transparent_.count(texname) > 0;
+    }
+
+    // Share the GL textures with the registries of the same key in other contexts of the
+    // group, which need the same materials, max_texture_size and use_texture_array.
+    // The next activate() only uploads the textures if no context of the group has them.
+    void set_share_group(std::shared_ptr<ShareGroup> group, std::string key) {
+      share_group_ = std::move(group);
+      share_key_ = std::move(key);
     }
 
     // populate map_ by texture_images_
     void activate();
     void deactivate();
 
+    // Drop the decoded images, e.g. after activate(). They are fetched
+    // from TextureStore again by the next activate().
+    void release_host_data();
+
+    // bytes of the GL textures created by activate()
+    size_t gpu_bytes() const;
+    // bytes of the decoded images, some of which may be shared with other registries
+    size_t host_bytes() const;
+
   private:
     bool activated_ = false;
-    // load a texture to OpenGL and return its texture id
-    void loadTexture(const std::string& texname);
-
-    // texname -> image, loaded and cached at the beginning
-    std::unordered_map<std::string, Matuc> texture_images_;
+    bool use_texture_array_;
+    int max_texture_size_;
+    // decode the textures and assign their layout
+    void loadTextures();
+    // decode the texture files with multiple threads, in the order of filenames_
+    std::vector<std::shared_ptr<const Matuc>> decodeTextures() const;
+    void activateArrays();
+    // create the GL textures of texture_images_
+    void upload_();
+
+    void wait_() const {
+      if (loading_.valid())
+        loading_.wait();
+    }
+    // ready when all textures are decoded
+    std::shared_future<void> loading_;
+
+    // all textures used by the materials, and their files
+    std::vector<std::string> texnames_, filenames_;
+    // texname -> image, loaded at the beginning and shared with other registries
+    std::unordered_map<std::string, std::shared_ptr<const Matuc>> texture_images_;
+    bool images_released_ = false;
+    // total bytes of the images
+    size_t image_bytes_ = 0;
+    // texnames with alpha channel
+    std::unordered_set<std::string> transparent_;
     // texname -> opengl resource id
     std::unordered_map<std::string, GLuint> map_;
     std::string base_dir_;
+
+    // texname -> location in the arrays, used with use_texture_array_
+    std::unordered_map<std::string, Layer> layers_;
+    // (width, height) -> index of the texture array
+    std::map<std::pair<int, int>, int> array_index_;
+    // size of each array, as (width, height, number of layers)
+    std::vector<std::array<int, 3>> array_shape_;
+    // opengl resource id of each array
+    std::vector<GLuint> arrays_;
+
+    std::shared_ptr<ShareGroup> share_group_;
+    std::string share_key_;
+    // the textures in map_ or arrays_, if they are shared
+    std::shared_ptr<ShareGroup::Objects> shared_textures_;
 };
 
 
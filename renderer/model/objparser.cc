@@ -0,0 +1,476 @@
+// Copyright 2017-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the license found in the
+// LICENSE file in the root directory of this source tree.
+//File: objparser.cc
+
+#include "objparser.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <thread>
+
+#include "lib/mappedfile.hh"
+
+using namespace std;
+
+namespace {
+
+// files smaller than this are parsed in one chunk
+const size_t MIN_CHUNK_SIZE = 1 << 20;
+
+inline bool is_space(char c) { return c == ' ' || c == '\t'; }
+
+// the i-th char of the line, or '\0' past the end
+inline char at(const char* p, const char* end, size_t i) {
+  return p + i < end ? p[i] : '\0';
+}
+
+inline const char* skip_space(const char* p, const char* end) {
+  while (p < end && is_space(*p)) ++p;
+  return p;
+}
+
+// skip to the first char in `delims`, like strcspn
+inline const char* skip_until(const char* p, const char* end, const char* delims) {
+  while (p < end && !strchr(delims, *p)) ++p;
+  return p;
+}
+
+// Like atoi: optional sign followed by digits. Returns 0 if there is no digit.
+inline int parse_int(const char* p, const char* end) {
+  bool neg = false;
+  if (p < end && (*p == '-' || *p == '+'))
+    neg = *p++ == '-';
+  int ret = 0;
+  for (; p < end && *p >= '0' && *p <= '9'; ++p)
+    ret = ret * 10 + (*p - '0');
+  return neg ? -ret : ret;
+}
+
+// Parse a float in [p, end). Returns false if there is no integer part.
+// Numbers with at most 19 significant digits and small exponents are computed exactly
+// from the integer mantissa (which covers everything in SUNCG), others fall back to strtod.
+bool parse_float(const char* p, const char* end, float* result) {
+  static const double POW10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+  const char* begin = p;
+  bool neg = false;
+  if (p < end && (*p == '-' || *p == '+'))
+    neg = *p++ == '-';
+  uint64_t mantissa = 0;
+  int num_digits = 0, exponent = 0;
+  bool has_digit = false;
+  for (; p < end && *p >= '0' && *p <= '9'; ++p) {
+    has_digit = true;
+    if (mantissa == 0 && *p == '0') continue;   // leading zeros
+    if (num_digits < 19) {
+      mantissa = mantissa * 10 + (*p - '0');
+      ++num_digits;
+    } else {
+      ++exponent;
+      ++num_digits;
+    }
+  }
+  // like tinyobj, an integer part is required
+  if (!has_digit)
+    return false;
+  if (p < end && *p == '.') {
+    for (++p; p < end && *p >= '0' && *p <= '9'; ++p) {
+      if (mantissa == 0 && *p == '0') {
+        --exponent;
+        continue;
+      }
+      if (num_digits < 19) {
+        mantissa = mantissa * 10 + (*p - '0');
+        --exponent;
+      }
+      ++num_digits;
+    }
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    bool exp_neg = false;
+    const char* q = p + 1;
+    if (q < end && (*q == '-' || *q == '+'))
+      exp_neg = *q++ == '-';
+    if (q < end && *q >= '0' && *q <= '9') {
+      int e = 0;
+      for (; q < end && *q >= '0' && *q <= '9'; ++q)
+        e = std::min(e * 10 + (*q - '0'), 100000);
+      exponent += exp_neg ? -e : e;
+    }
+  }
+  double val;
+  if (num_digits <= 19 && mantissa < (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+    val = static_cast<double>(mantissa);
+    val = exponent < 0 ? val / POW10[-exponent] : val * POW10[exponent];
+  } else {
+    string s(begin, end);
+    val = fabs(strtod(s.c_str(), nullptr));
+  }
+  *result = static_cast<float>(neg ? -val : val);
+  return true;
+}
+
+// Like tinyobj's parseReal: the next whitespace-delimited number, or 0.
+inline float parse_real(const char** p, const char* end) {
+  const char* b = skip_space(*p, end);
+  const char* e = skip_until(b, end, " \t\r");
+  float ret = 0;
+  parse_float(b, e, &ret);
+  *p = e;
+  return ret;
+}
+
+// One corner of a face. Indices are 0-based, -1 for a missing index.
+// Relative (negative) indices are resolved against the chunk and marked
+// in `relative`, to be shifted by the number of elements before the chunk.
+struct Corner {
+  int v, vt, vn;
+  uint8_t relative;
+};
+
+enum RelativeBit : uint8_t { REL_V = 1, REL_VT = 2, REL_VN = 4 };
+
+// The records that change the state of tinyobj's parser
+struct Event {
+  enum Type { USEMTL, MTLLIB, GROUP, OBJECT } type;
+  size_t face;    // number of faces in the chunk before this event
+  string arg;
+};
+
+struct Chunk {
+  vector<tinyobj::real_t> v, vn, vt;
+  vector<Corner> corners;
+  vector<int> face_size;
+  vector<Event> events;
+  bool failed = false;
+};
+
+// Like tinyobj's fixIndex. n is the number of elements parsed so far in the chunk.
+inline bool fix_index(int idx, int n, uint8_t bit, int* ret, uint8_t* relative) {
+  if (idx > 0) {
+    *ret = idx - 1;
+    return true;
+  }
+  if (idx == 0)
+    return false;
+  *ret = n + idx;
+  *relative |= bit;
+  return true;
+}
+
+// Parse i, i/j/k, i//k or i/j, like tinyobj's parseTriple
+bool parse_triple(const char** token, const char* end, const Chunk& chunk, Corner* c) {
+  const char* p = *token;
+  c->v = c->vt = c->vn = -1;
+  c->relative = 0;
+  int nv = chunk.v.size() / 3, nvn = chunk.vn.size() / 3, nvt = chunk.vt.size() / 2;
+  static const char* DELIMS = "/ \t\r";
+
+  if (!fix_index(parse_int(p, end), nv, REL_V, &c->v, &c->relative))
+    return false;
+  p = skip_until(p, end, DELIMS);
+  if (at(p, end, 0) == '/') {
+    ++p;
+    if (at(p, end, 0) == '/') {   // i//k
+      ++p;
+      if (!fix_index(parse_int(p, end), nvn, REL_VN, &c->vn, &c->relative))
+        return false;
+      p = skip_until(p, end, DELIMS);
+    } else {
+      if (!fix_index(parse_int(p, end), nvt, REL_VT, &c->vt, &c->relative))
+        return false;
+      p = skip_until(p, end, DELIMS);
+      if (at(p, end, 0) == '/') {   // i/j/k
+        ++p;
+        if (!fix_index(parse_int(p, end), nvn, REL_VN, &c->vn, &c->relative))
+          return false;
+        p = skip_until(p, end, DELIMS);
+      }
+    }
+  }
+  *token = p;
+  return true;
+}
+
+void parse_line(const char* token, const char* end, Chunk& chunk) {
+  token = skip_space(token, end);
+  char c0 = at(token, end, 0), c1 = at(token, end, 1);
+  if (c0 == '\0' || c0 == '#')
+    return;
+
+  if (c0 == 'v' && is_space(c1)) {
+    token += 2;
+    for (int k = 0; k < 3; ++k)
+      chunk.v.push_back(parse_real(&token, end));
+    return;
+  }
+  if (c0 == 'v' && c1 == 'n' && is_space(at(token, end, 2))) {
+    token += 3;
+    for (int k = 0; k < 3; ++k)
+      chunk.vn.push_back(parse_real(&token, end));
+    return;
+  }
+  if (c0 == 'v' && c1 == 't' && is_space(at(token, end, 2))) {
+    token += 3;
+    for (int k = 0; k < 2; ++k)
+      chunk.vt.push_back(parse_real(&token, end));
+    return;
+  }
+  if (c0 == 'f' && is_space(c1)) {
+    token = skip_space(token + 2, end);
+    int n = 0;
+    while (token < end) {
+      Corner corner;
+      if (!parse_triple(&token, end, chunk, &corner)) {
+        chunk.failed = true;
+        return;
+      }
+      chunk.corners.push_back(corner);
+      ++n;
+      while (token < end && strchr(" \t\r", *token)) ++token;
+    }
+    chunk.face_size.push_back(n);
+    return;
+  }
+
+  size_t len = end - token;
+  auto keyword = [&](const char* kw) {
+    size_t n = strlen(kw);
+    return len > n && memcmp(token, kw, n) == 0 && is_space(token[n]);
+  };
+  if (keyword("usemtl")) {
+    chunk.events.emplace_back(Event{Event::USEMTL, chunk.face_size.size(), string(token + 7, end)});
+  } else if (keyword("mtllib")) {
+    chunk.events.emplace_back(Event{Event::MTLLIB, chunk.face_size.size(), string(token + 7, end)});
+  } else if (c0 == 'g' && is_space(c1)) {
+    // names[0] is 'g'; the group name is names[1]
+    string name;
+    const char* p = skip_until(token, end, " \t\r");
+    p = skip_space(p, end);
+    if (p < end)
+      name.assign(p, skip_until(p, end, " \t\r"));
+    chunk.events.emplace_back(Event{Event::GROUP, chunk.face_size.size(), name});
+  } else if (c0 == 'o' && is_space(c1)) {
+    chunk.events.emplace_back(Event{Event::OBJECT, chunk.face_size.size(), string(token + 2, end)});
+  }
+  // Ignore unknown command.
+}
+
+void parse_chunk(const char* begin, const char* end, Chunk* chunk) {
+  // lines are terminated by '\n', '\r' or "\r\n", like tinyobj's safeGetline
+  const char* p = begin;
+  while (p < end && !chunk->failed) {
+    const char* eol = p;
+    while (eol < end && *eol != '\n' && *eol != '\r') ++eol;
+    if (eol > p)
+      parse_line(p, eol, *chunk);
+    p = eol + 1;
+  }
+}
+
+// Replays the face groups and state changes of all chunks in order,
+// the same way as tinyobj::LoadObj.
+class ShapeBuilder {
+  public:
+    ShapeBuilder(vector<tinyobj::shape_t>* shapes,
+        vector<tinyobj::material_t>* materials, string* err,
+        const string& mtl_basedir):
+      shapes_{shapes}, materials_{materials}, err_{err},
+      mtl_reader_{mtl_basedir} {}
+
+    void add_chunk(const Chunk& chunk, int v_offset, int vn_offset, int vt_offset) {
+      size_t face = 0, corner = 0;
+      auto add_faces_until = [&](size_t end_face) {
+        for (; face < end_face; ++face) {
+          int n = chunk.face_size[face];
+          const Corner* c = &chunk.corners[corner];
+          corner += n;
+          // triangle fan
+          for (int k = 2; k < n; ++k) {
+            shape_.mesh.indices.push_back(resolve(c[0], v_offset, vn_offset, vt_offset));
+            shape_.mesh.indices.push_back(resolve(c[k - 1], v_offset, vn_offset, vt_offset));
+            shape_.mesh.indices.push_back(resolve(c[k], v_offset, vn_offset, vt_offset));
+            shape_.mesh.num_face_vertices.push_back(3);
+            shape_.mesh.material_ids.push_back(material_);
+          }
+          ++group_size_;
+        }
+      };
+      for (auto& e : chunk.events) {
+        add_faces_until(e.face);
+        handle(e);
+      }
+      add_faces_until(chunk.face_size.size());
+    }
+
+    void finish() {
+      if (flush_group() || shape_.mesh.indices.size())
+        shapes_->push_back(move(shape_));
+    }
+
+  private:
+    static tinyobj::index_t resolve(const Corner& c, int v_offset, int vn_offset, int vt_offset) {
+      tinyobj::index_t ret;
+      ret.vertex_index = c.v + (c.relative & REL_V ? v_offset : 0);
+      ret.texcoord_index = c.vt + (c.relative & REL_VT ? vt_offset : 0);
+      ret.normal_index = c.vn + (c.relative & REL_VN ? vn_offset : 0);
+      return ret;
+    }
+
+    // Faces are added to the shape as soon as they are seen.
+    // Ending a face group only sets the shape name, as in exportFaceGroupToShape.
+    bool flush_group() {
+      if (group_size_ == 0)
+        return false;
+      shape_.name = name_;
+      group_size_ = 0;
+      return true;
+    }
+
+    void handle(const Event& e) {
+      switch (e.type) {
+        case Event::USEMTL: {
+          auto itr = material_map_.find(e.arg);
+          int id = itr == material_map_.end() ? -1 : itr->second;
+          if (id != material_) {
+            flush_group();
+            material_ = id;
+          }
+          break;
+        }
+        case Event::MTLLIB: {
+          vector<string> filenames;
+          stringstream ss{e.arg};
+          string item;
+          while (getline(ss, item, ' '))
+            filenames.push_back(item);
+          if (filenames.empty()) {
+            *err_ += "WARN: Looks like empty filename for mtllib. Use default material. \n";
+            break;
+          }
+          bool found = false;
+          for (auto& f : filenames) {
+            string err_mtl;
+            bool ok = mtl_reader_(f.c_str(), materials_, &material_map_, &err_mtl);
+            *err_ += err_mtl;
+            if (ok) {
+              found = true;
+              break;
+            }
+          }
+          if (!found)
+            *err_ += "WARN: Failed to load material file(s). Use default material.\n";
+          break;
+        }
+        case Event::GROUP:
+          flush_group();
+          if (shape_.mesh.indices.size() > 0)
+            shapes_->push_back(move(shape_));
+          shape_ = tinyobj::shape_t();
+          name_ = e.arg;
+          break;
+        case Event::OBJECT:
+          if (flush_group())
+            shapes_->push_back(move(shape_));
+          shape_ = tinyobj::shape_t();
+          name_ = e.arg;
+          break;
+      }
+    }
+
+    vector<tinyobj::shape_t>* shapes_;
+    vector<tinyobj::material_t>* materials_;
+    string* err_;
+    tinyobj::MaterialFileReader mtl_reader_;
+    map<string, int> material_map_;
+
+    tinyobj::shape_t shape_;
+    string name_;
+    int material_ = -1;
+    size_t group_size_ = 0;   // number of faces in the current face group
+};
+
+}   // namespace
+
+namespace render {
+
+bool parallelLoadObj(
+    tinyobj::attrib_t* attrib, vector<tinyobj::shape_t>* shapes,
+    vector<tinyobj::material_t>* materials, string* err,
+    const string& fname, const string& mtl_basedir, int num_threads) {
+  attrib->vertices.clear();
+  attrib->normals.clear();
+  attrib->texcoords.clear();
+  shapes->clear();
+
+  MappedFile file{fname};
+  const char* data = file.data();
+  size_t size = file.size();
+
+  if (num_threads <= 0)
+    num_threads = std::max<int>(thread::hardware_concurrency(), 1);
+  int num_chunks = std::max<size_t>(std::min<size_t>(num_threads, size / MIN_CHUNK_SIZE), 1);
+
+  // split on line boundaries
+  vector<const char*> bounds{data};
+  for (int i = 1; i < num_chunks; ++i) {
+    const char* p = std::max(data + size * i / num_chunks, bounds.back());
+    p = static_cast<const char*>(memchr(p, '\n', data + size - p));
+    if (p == nullptr)
+      break;
+    bounds.push_back(p + 1);
+  }
+  bounds.push_back(data + size);
+  num_chunks = bounds.size() - 1;
+
+  vector<Chunk> chunks(num_chunks);
+  vector<thread> threads;
+  for (int i = 1; i < num_chunks; ++i)
+    threads.emplace_back(parse_chunk, bounds[i], bounds[i + 1], &chunks[i]);
+  parse_chunk(bounds[0], bounds[1], &chunks[0]);
+  for (auto& th : threads)
+    th.join();
+
+  for (auto& c : chunks) {
+    if (c.failed) {
+      if (err)
+        *err = "Failed parse `f' line(e.g. zero value for face index).\n";
+      return false;
+    }
+  }
+
+  string warnings;
+  ShapeBuilder builder{shapes, materials, &warnings, mtl_basedir};
+  size_t nv = 0, nvn = 0, nvt = 0;
+  for (auto& c : chunks) {
+    nv += c.v.size();
+    nvn += c.vn.size();
+    nvt += c.vt.size();
+  }
+  attrib->vertices.reserve(nv);
+  attrib->normals.reserve(nvn);
+  attrib->texcoords.reserve(nvt);
+  for (auto& c : chunks) {
+    builder.add_chunk(c, attrib->vertices.size() / 3,
+        attrib->normals.size() / 3, attrib->texcoords.size() / 2);
+    attrib->vertices.insert(attrib->vertices.end(), c.v.begin(), c.v.end());
+    attrib->normals.insert(attrib->normals.end(), c.vn.begin(), c.vn.end());
+    attrib->texcoords.insert(attrib->texcoords.end(), c.vt.begin(), c.vt.end());
+    decltype(c.corners)().swap(c.corners);
+  }
+  builder.finish();
+  if (err)
+    *err += warnings;
+  return true;
+}
+
+}   // namespace render
@@ -0,0 +1,27 @@
+// Copyright 2017-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the license found in the
+// LICENSE file in the root directory of this source tree.
+//File: objparser.hh
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <tiny_obj_loader.h>
+
+namespace render {
+
+// A drop-in replacement of tinyobj::LoadObj (with triangulation) for large obj files.
+// The file is mmapped and split into chunks on line boundaries, which are parsed
+// in parallel and then merged into the same attrib/shapes/materials as tinyobj.
+// num_threads <= 0 means to use all the cores.
+// Tags ('t' lines) are not supported and ignored.
+bool parallelLoadObj(
+    tinyobj::attrib_t* attrib, std::vector<tinyobj::shape_t>* shapes,
+    std::vector<tinyobj::material_t>* materials, std::string* err,
+    const std::string& fname, const std::string& mtl_basedir,
+    int num_threads = 0);
+
+}
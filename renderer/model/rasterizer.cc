@@ -0,0 +1,419 @@
+// Copyright 2017-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the license found in the
+// LICENSE file in the root directory of this source tree.
+//File: rasterizer.cc
+
+#include "rasterizer.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "lib/debugutils.hh"
+
+using namespace std;
+
+namespace render {
+
+struct TileRasterizer::Triangle {
+  // Pixel (px, py) is inside if a[i] * px + (b[i] * py + c[i]) >= 0 for each edge i,
+  // where 0 only counts on the top-left edges. A triangle sharing an edge evaluates
+  // exactly the negated function, so the pixels on the edge are drawn once.
+  float a[3], b[3], c[3];
+  // the window depth at (px, py) is zdx * px + (z0 + zdy * py)
+  float z0, zdx, zdy;
+  float zmin;     // of the vertices
+  // pixels covered by the bounding box, inclusive
+  int xmin, xmax, ymin, ymax;
+  int32_t id;
+  int top_left;   // bit i is set if edge i is a top-left edge
+};
+
+struct TileRasterizer::Chunk {
+  // meshes visible_[first, last)
+  int first, last;
+  std::vector<Triangle> triangles;
+  // indices of the triangles overlapping each tile, in drawing order
+  std::vector<std::vector<uint32_t>> bins;
+  // clip coordinates of the vertices of the current mesh
+  std::vector<glm::vec4> clip;
+};
+
+namespace {
+
+const int BLOCKS_PER_ROW = TileRasterizer::TILE_SIZE / TileRasterizer::BLOCK_SIZE;
+const int BLOCKS_PER_TILE = BLOCKS_PER_ROW * BLOCKS_PER_ROW;
+const int NEAR_PLANE = 1 << 4;
+
+// the clipping planes a vertex is outside of
+inline int outcode(const glm::vec4& v) {
+  return (v.x < -v.w) | (v.x > v.w) << 1 | (v.y < -v.w) << 2 | (v.y > v.w) << 3 |
+    (v.z < -v.w) << 4 | (v.z > v.w) << 5;
+}
+
+// The point on segment (in, out) at the near plane, where din and dout
+// are the distances to the plane. Always interpolated from the inside vertex,
+// so that triangles sharing the segment get the same point.
+inline glm::vec4 intersect_near(const glm::vec4& in, const glm::vec4& out, float din, float dout) {
+  float t = din / (din - dout);
+  return glm::vec4(in.x + t * (out.x - in.x), in.y + t * (out.y - in.y),
+      in.z + t * (out.z - in.z), in.w + t * (out.w - in.w));
+}
+
+}
+
+vector<TileRasterizer::MeshBounds> TileRasterizer::compute_bounds(const MergedMesh& mesh) {
+  m_assert(mesh.has_host_data());
+  const Vertex* vertices = mesh.vertex_data();
+  const GLuint* indices = mesh.index_data();
+  vector<MeshBounds> ret(mesh.size());
+  for (int i = 0; i < mesh.size(); ++i) {
+    MeshBounds& b = ret[i];
+    b.min = glm::vec3(numeric_limits<float>::max());
+    b.max = glm::vec3(numeric_limits<float>::lowest());
+    b.first_vertex = numeric_limits<GLuint>::max();
+    b.last_vertex = 0;
+    for (int k = mesh.first[i]; k < mesh.first[i] + mesh.count[i]; ++k) {
+      GLuint v = indices[k];
+      b.first_vertex = std::min(b.first_vertex, v);
+      b.last_vertex = std::max(b.last_vertex, v);
+      b.min = glm::min(b.min, vertices[v].pos);
+      b.max = glm::max(b.max, vertices[v].pos);
+    }
+  }
+  return ret;
+}
+
+TileRasterizer::TileRasterizer(int num_threads) {
+  if (num_threads <= 0)
+    num_threads = std::max(thread::hardware_concurrency(), 1u);
+  for (int i = 1; i < num_threads; ++i)
+    workers_.emplace_back([this]() { this->work_(); });
+}
+
+TileRasterizer::~TileRasterizer() {
+  {
+    lock_guard<mutex> lg(mutex_);
+    stopped_ = true;
+  }
+  start_cv_.notify_all();
+  for (auto& th : workers_)
+    th.join();
+}
+
+void TileRasterizer::resize_(Geometry geo) {
+  if (geo.w == geo_.w && geo.h == geo_.h)
+    return;
+  geo_ = geo;
+  tiles_x_ = (geo.w + TILE_SIZE - 1) / TILE_SIZE;
+  tiles_y_ = (geo.h + TILE_SIZE - 1) / TILE_SIZE;
+  stride_ = tiles_x_ * TILE_SIZE;
+  depth_.resize(stride_ * tiles_y_ * TILE_SIZE);
+  ids_.resize(depth_.size());
+  block_depth_.resize(tiles_x_ * tiles_y_ * BLOCKS_PER_TILE);
+}
+
+bool TileRasterizer::is_outside_(const MeshBounds& bounds, const glm::mat4& projection) {
+  int code = ~0;
+  for (int i = 0; i < 8; ++i) {
+    glm::vec3 corner{i & 1 ? bounds.max.x : bounds.min.x,
+      i & 2 ? bounds.max.y : bounds.min.y, i & 4 ? bounds.max.z : bounds.min.z};
+    code &= outcode(projection * glm::vec4(corner, 1.f));
+  }
+  return code != 0;
+}
+
+void TileRasterizer::draw(const MergedMesh& mesh, const vector<MeshBounds>& bounds,
+    const glm::mat4& projection, Geometry geo) {
+  m_assert(mesh.has_host_data());
+  m_assert((int)bounds.size() == mesh.size());
+  resize_(geo);
+
+  visible_.clear();
+  size_t num_indices = 0;
+  for (int i = 0; i < mesh.size(); ++i) {
+    if (mesh.count[i] > 0 && !is_outside_(bounds[i], projection)) {
+      visible_.push_back(i);
+      num_indices += mesh.count[i];
+    }
+  }
+  // several chunks per thread, to balance the load
+  num_chunks_ = std::min<int>(visible_.size(), workers_.empty() ? 1 : num_threads() * 4);
+  if ((int)chunks_.size() < num_chunks_)
+    chunks_.resize(num_chunks_);
+  size_t acc = 0;
+  for (int k = 0, c = 0; c < num_chunks_; ++c) {
+    Chunk& chunk = chunks_[c];
+    chunk.first = k;
+    // the last chunk takes the rest
+    while (k < (int)visible_.size() &&
+        (c == num_chunks_ - 1 || acc < num_indices * (c + 1) / num_chunks_))
+      acc += mesh.count[visible_[k++]];
+    chunk.last = k;
+    chunk.triangles.clear();
+    chunk.bins.resize(tiles_x_ * tiles_y_);
+    for (auto& bin : chunk.bins)
+      bin.clear();
+  }
+
+  parallel_for_(num_chunks_, [&](int c) {
+        this->setup_chunk_(chunks_[c], mesh, bounds, projection);
+      });
+  parallel_for_(tiles_x_ * tiles_y_, [this](int tile) {
+        this->rasterize_tile_(tile);
+      });
+}
+
+void TileRasterizer::setup_chunk_(Chunk& chunk, const MergedMesh& mesh,
+    const vector<MeshBounds>& bounds, const glm::mat4& projection) {
+  const Vertex* vertices = mesh.vertex_data();
+  const GLuint* indices = mesh.index_data();
+  for (int k = chunk.first; k < chunk.last; ++k) {
+    int m = visible_[k];
+    const MeshBounds& b = bounds[m];
+    chunk.clip.resize(b.last_vertex - b.first_vertex + 1);
+    for (GLuint v = b.first_vertex; v <= b.last_vertex; ++v)
+      chunk.clip[v - b.first_vertex] = projection * glm::vec4(vertices[v].pos, 1.f);
+    const GLuint* idx = indices + mesh.first[m];
+    const glm::vec4* clip = chunk.clip.data() - b.first_vertex;
+    for (int i = 0; i + 2 < mesh.count[m]; i += 3)
+      setup_triangle_(chunk, clip[idx[i]], clip[idx[i + 1]], clip[idx[i + 2]], m);
+  }
+}
+
+void TileRasterizer::setup_triangle_(Chunk& chunk, const glm::vec4& v0,
+    const glm::vec4& v1, const glm::vec4& v2, int32_t id) {
+  int c0 = outcode(v0), c1 = outcode(v1), c2 = outcode(v2);
+  if (c0 & c1 & c2)
+    return;
+  if (!((c0 | c1 | c2) & NEAR_PLANE)) {
+    // the other planes are handled by the bounding box and the depth test
+    add_triangle_(chunk, v0, v1, v2, id);
+    return;
+  }
+  // clip by the near plane z >= -w, into a triangle or a quad
+  const glm::vec4* v[3] = {&v0, &v1, &v2};
+  glm::vec4 poly[4];
+  int n = 0;
+  for (int i = 0; i < 3; ++i) {
+    const glm::vec4& a = *v[i];
+    const glm::vec4& b = *v[(i + 1) % 3];
+    float da = a.z + a.w, db = b.z + b.w;
+    if (da >= 0)
+      poly[n++] = a;
+    if ((da >= 0) != (db >= 0))
+      poly[n++] = da >= 0 ? intersect_near(a, b, da, db) : intersect_near(b, a, db, da);
+  }
+  for (int i = 2; i < n; ++i)
+    add_triangle_(chunk, poly[0], poly[i - 1], poly[i], id);
+}
+
+void TileRasterizer::add_triangle_(Chunk& chunk, const glm::vec4& v0,
+    const glm::vec4& v1, const glm::vec4& v2, int32_t id) {
+  // window coordinates
+  float x[3], y[3], z[3];
+  const glm::vec4* v[3] = {&v0, &v1, &v2};
+  for (int i = 0; i < 3; ++i) {
+    float inv_w = 1.f / v[i]->w;
+    x[i] = (v[i]->x * inv_w * 0.5f + 0.5f) * geo_.w;
+    y[i] = (v[i]->y * inv_w * 0.5f + 0.5f) * geo_.h;
+    z[i] = v[i]->z * inv_w * 0.5f + 0.5f;
+  }
+  float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+  // back faces (clockwise), empty triangles and NaNs
+  if (!(area > 0))
+    return;
+
+  Triangle t;
+  t.zmin = std::max(std::min({z[0], z[1], z[2]}), 0.f);
+  // behind the far plane
+  if (t.zmin >= 1.f)
+    return;
+  // pixels whose centers are inside the bounding box
+  t.xmin = std::max(0.f, std::ceil(std::min({x[0], x[1], x[2]}) - 0.5f));
+  t.xmax = std::min(geo_.w - 1.f, std::floor(std::max({x[0], x[1], x[2]}) - 0.5f));
+  t.ymin = std::max(0.f, std::ceil(std::min({y[0], y[1], y[2]}) - 0.5f));
+  t.ymax = std::min(geo_.h - 1.f, std::floor(std::max({y[0], y[1], y[2]}) - 0.5f));
+  if (t.xmin > t.xmax || t.ymin > t.ymax)
+    return;
+
+  t.top_left = 0;
+  for (int i = 0; i < 3; ++i) {
+    int j = (i + 1) % 3;
+    t.a[i] = y[i] - y[j];
+    t.b[i] = x[j] - x[i];
+    t.c[i] = x[i] * y[j] - x[j] * y[i];
+    if (t.a[i] > 0 || (t.a[i] == 0 && t.b[i] < 0))
+      t.top_left |= 1 << i;
+  }
+  t.zdx = ((z[1] - z[0]) * (y[2] - y[0]) - (z[2] - z[0]) * (y[1] - y[0])) / area;
+  t.zdy = ((z[2] - z[0]) * (x[1] - x[0]) - (z[1] - z[0]) * (x[2] - x[0])) / area;
+  t.z0 = z[0] - t.zdx * x[0] - t.zdy * y[0];
+  t.id = id;
+
+  uint32_t index = chunk.triangles.size();
+  chunk.triangles.push_back(t);
+  for (int ty = t.ymin / TILE_SIZE; ty <= t.ymax / TILE_SIZE; ++ty)
+    for (int tx = t.xmin / TILE_SIZE; tx <= t.xmax / TILE_SIZE; ++tx)
+      chunk.bins[ty * tiles_x_ + tx].push_back(index);
+}
+
+void TileRasterizer::rasterize_tile_(int tile) {
+  int x0 = tile % tiles_x_ * TILE_SIZE, y0 = tile / tiles_x_ * TILE_SIZE;
+  for (int y = y0; y < y0 + TILE_SIZE; ++y) {
+    std::fill_n(&depth_[y * stride_ + x0], TILE_SIZE, 1.f);
+    std::fill_n(&ids_[y * stride_ + x0], TILE_SIZE, -1);
+  }
+  float* block_depth = &block_depth_[tile * BLOCKS_PER_TILE];
+  std::fill_n(block_depth, BLOCKS_PER_TILE, 1.f);
+
+  // in the order of the meshes, as GL draws them
+  for (int c = 0; c < num_chunks_; ++c) {
+    const Chunk& chunk = chunks_[c];
+    for (uint32_t index : chunk.bins[tile]) {
+      const Triangle& t = chunk.triangles[index];
+      int xmin = std::max(t.xmin, x0), xmax = std::min(t.xmax, x0 + TILE_SIZE - 1);
+      int ymin = std::max(t.ymin, y0), ymax = std::min(t.ymax, y0 + TILE_SIZE - 1);
+      for (int by = (ymin - y0) / BLOCK_SIZE; by <= (ymax - y0) / BLOCK_SIZE; ++by) {
+        for (int bx = (xmin - x0) / BLOCK_SIZE; bx <= (xmax - x0) / BLOCK_SIZE; ++bx) {
+          float& farthest = block_depth[by * BLOCKS_PER_ROW + bx];
+          // every pixel of the block is in front of the triangle
+          if (t.zmin >= farthest)
+            continue;
+          int bx0 = x0 + bx * BLOCK_SIZE, by0 = y0 + by * BLOCK_SIZE;
+          bool written = rasterize_block_(t,
+              std::max(xmin, bx0) & ~3, std::min(xmax, bx0 + BLOCK_SIZE - 1),
+              std::max(ymin, by0), std::min(ymax, by0 + BLOCK_SIZE - 1));
+          if (written) {
+            float m = 0;
+            for (int y = by0; y < by0 + BLOCK_SIZE; ++y)
+              for (int x = bx0; x < bx0 + BLOCK_SIZE; ++x)
+                m = std::max(m, depth_[y * stride_ + x]);
+            farthest = m;
+          }
+        }
+      }
+    }
+  }
+}
+
+bool TileRasterizer::rasterize_block_(const Triangle& t, int x0, int x1, int y0, int y1) {
+  bool written = false;
+#ifdef __SSE2__
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 lanes = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+  __m128 a[3], top_left[3];
+  for (int i = 0; i < 3; ++i) {
+    a[i] = _mm_set1_ps(t.a[i]);
+    top_left[i] = _mm_castsi128_ps(_mm_set1_epi32(t.top_left >> i & 1 ? -1 : 0));
+  }
+  const __m128 zdx = _mm_set1_ps(t.zdx);
+  const __m128i id = _mm_set1_epi32(t.id);
+  for (int y = y0; y <= y1; ++y) {
+    float py = y + 0.5f;
+    __m128 row[3];
+    for (int i = 0; i < 3; ++i)
+      row[i] = _mm_set1_ps(t.b[i] * py + t.c[i]);
+    const __m128 zrow = _mm_set1_ps(t.z0 + t.zdy * py);
+    float* depth = &depth_[y * stride_];
+    int32_t* ids = &ids_[y * stride_];
+    for (int x = x0; x <= x1; x += 4) {
+      __m128 px = _mm_add_ps(_mm_set1_ps(x), lanes);
+      __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+      for (int i = 0; i < 3; ++i) {
+        __m128 e = _mm_add_ps(_mm_mul_ps(a[i], px), row[i]);
+        inside = _mm_and_ps(inside, _mm_or_ps(_mm_cmpgt_ps(e, zero),
+              _mm_and_ps(_mm_cmpeq_ps(e, zero), top_left[i])));
+      }
+      if (!_mm_movemask_ps(inside))
+        continue;
+      __m128 z = _mm_add_ps(_mm_mul_ps(zdx, px), zrow);
+      __m128 old = _mm_load_ps(depth + x);
+      __m128 pass = _mm_and_ps(inside, _mm_cmplt_ps(z, old));
+      if (!_mm_movemask_ps(pass))
+        continue;
+      _mm_store_ps(depth + x, _mm_or_ps(_mm_and_ps(pass, z), _mm_andnot_ps(pass, old)));
+      __m128i mask = _mm_castps_si128(pass);
+      __m128i* id_ptr = reinterpret_cast<__m128i*>(ids + x);
+      _mm_store_si128(id_ptr, _mm_or_si128(_mm_and_si128(mask, id),
+            _mm_andnot_si128(mask, _mm_load_si128(id_ptr))));
+      written = true;
+    }
+  }
+#else
+  for (int y = y0; y <= y1; ++y) {
+    float py = y + 0.5f;
+    float* depth = &depth_[y * stride_];
+    int32_t* ids = &ids_[y * stride_];
+    for (int x = x0; x <= x1; ++x) {
+      float px = x + 0.5f;
+      bool inside = true;
+      for (int i = 0; i < 3; ++i) {
+        float e = t.a[i] * px + (t.b[i] * py + t.c[i]);
+        inside = inside && (e > 0 || (e == 0 && (t.top_left >> i & 1)));
+      }
+      if (!inside)
+        continue;
+      float z = t.zdx * px + (t.z0 + t.zdy * py);
+      if (z < depth[x]) {
+        depth[x] = z;
+        ids[x] = t.id;
+        written = true;
+      }
+    }
+  }
+#endif
+  return written;
+}
+
+void TileRasterizer::parallel_for_(int n, const std::function<void(int)>& job) {
+  if (workers_.empty() || n <= 1) {
+    for (int i = 0; i < n; ++i)
+      job(i);
+    return;
+  }
+  {
+    lock_guard<mutex> lg(mutex_);
+    job_ = &job;
+    num_jobs_ = n;
+    next_job_.store(0);
+    num_running_ = workers_.size();
+    ++generation_;
+  }
+  start_cv_.notify_all();
+  run_jobs_();
+  unique_lock<mutex> lk(mutex_);
+  done_cv_.wait(lk, [this]() { return num_running_ == 0; });
+  job_ = nullptr;
+}
+
+void TileRasterizer::run_jobs_() {
+  int i;
+  while ((i = next_job_++) < num_jobs_)
+    (*job_)(i);
+}
+
+void TileRasterizer::work_() {
+  size_t generation = 0;
+  while (true) {
+    {
+      unique_lock<mutex> lk(mutex_);
+      start_cv_.wait(lk, [&]() { return stopped_ || generation_ != generation; });
+      if (stopped_)
+        return;
+      generation = generation_;
+    }
+    run_jobs_();
+    lock_guard<mutex> lg(mutex_);
+    if (--num_running_ == 0)
+      done_cv_.notify_one();
+  }
+}
+
+} // namespace render
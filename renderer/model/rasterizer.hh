@@ -0,0 +1,120 @@
+// Copyright 2017-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the license found in the
+// LICENSE file in the root directory of this source tree.
+//File: rasterizer.hh
+
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "lib/geometry.hh"
+#include "mesh.hh"
+
+namespace render {
+
+// Rasterize the meshes of a MergedMesh on CPU, into a depth buffer and a buffer of mesh ids.
+// It does what GL does with the position-only shader: back faces are culled, triangles
+// are clipped by the near plane, and the depth test is GL_LESS. No GL context is needed.
+//
+// Triangles are set up and binned into tiles of TILE_SIZE x TILE_SIZE pixels, by chunks
+// of meshes in parallel. Then the tiles are rasterized in parallel, 4 pixels at a time with SSE.
+// Each tile keeps the farthest depth of its BLOCK_SIZE x BLOCK_SIZE blocks, so that the
+// triangles behind a block are skipped without testing its pixels.
+// Methods must not be called concurrently.
+class TileRasterizer {
+  public:
+    static const int TILE_SIZE = 16;
+    static const int BLOCK_SIZE = 8;
+
+    // Bounding box and vertex range of a mesh, to skip the meshes out of view
+    struct MeshBounds {
+      glm::vec3 min, max;
+      GLuint first_vertex, last_vertex;
+    };
+    // bounds of each mesh, which has to have host data
+    static std::vector<MeshBounds> compute_bounds(const MergedMesh& mesh);
+
+    // num_threads: 0 for one per CPU
+    explicit TileRasterizer(int num_threads=0);
+    ~TileRasterizer();
+
+    TileRasterizer(const TileRasterizer&) = delete;
+    TileRasterizer& operator = (const TileRasterizer&) = delete;
+
+    // Draw all meshes of `mesh` with the given projection (see Camera::getCameraMatrix),
+    // into buffers of size `geo`. The mesh has to have host data, and `bounds` are
+    // computed from it by compute_bounds().
+    void draw(const MergedMesh& mesh, const std::vector<MeshBounds>& bounds,
+        const glm::mat4& projection, Geometry geo);
+
+    // Results of the last draw(), with rows counted from the top, as in captured images.
+    // The window depth (gl_FragCoord.z) of pixel (x, y), or 1 if nothing is drawn there.
+    float depth(int x, int y) const { return depth_[offset_(x, y)]; }
+    // The index of the mesh drawn at pixel (x, y), or -1.
+    int32_t mesh_id(int x, int y) const { return ids_[offset_(x, y)]; }
+
+    int num_threads() const { return workers_.size() + 1; }
+
+  private:
+    struct Triangle;
+    struct Chunk;
+
+    Geometry geo_{0, 0};
+    int tiles_x_ = 0, tiles_y_ = 0;
+    // row y of the buffers is row y of the window, i.e. counted from the bottom.
+    // Padded to whole tiles.
+    int stride_ = 0;
+    std::vector<float> depth_;
+    std::vector<int32_t> ids_;
+    // the farthest depth of each block, by tile
+    std::vector<float> block_depth_;
+
+    // meshes in view, split into chunks of similar numbers of triangles
+    std::vector<int> visible_;
+    std::vector<Chunk> chunks_;
+    int num_chunks_ = 0;
+
+    size_t offset_(int x, int y) const { return (geo_.h - 1 - y) * stride_ + x; }
+    void resize_(Geometry geo);
+    // whether the bounding box is outside of a clipping plane
+    static bool is_outside_(const MeshBounds& bounds, const glm::mat4& projection);
+    void setup_chunk_(Chunk& chunk, const MergedMesh& mesh,
+        const std::vector<MeshBounds>& bounds, const glm::mat4& projection);
+    void setup_triangle_(Chunk& chunk, const glm::vec4& v0, const glm::vec4& v1,
+        const glm::vec4& v2, int32_t id);
+    // add a triangle which is in front of the near plane
+    void add_triangle_(Chunk& chunk, const glm::vec4& v0, const glm::vec4& v1,
+        const glm::vec4& v2, int32_t id);
+    void rasterize_tile_(int tile);
+    // Rasterize the triangle in pixels [x0, x1] x [y0, y1] of a block. x0 is a multiple of 4.
+    // Returns whether any pixel is written.
+    bool rasterize_block_(const Triangle& tri, int x0, int x1, int y0, int y1);
+
+    // Run job(0), ..., job(n - 1) with all threads
+    void parallel_for_(int n, const std::function<void(int)>& job);
+    void run_jobs_();
+    void work_();
+
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable start_cv_, done_cv_;
+    // the jobs of the current parallel_for_()
+    const std::function<void(int)>* job_ = nullptr;
+    int num_jobs_ = 0;
+    std::atomic<int> next_job_{0};
+    // number of workers still running the jobs
+    int num_running_ = 0;
+    // incremented by each parallel_for_()
+    size_t generation_ = 0;
+    bool stopped_ = false;
+};
+
+} // namespace render
@@ -86,7 +86,7 @@ void SimpleObjScene::parse_scene() {
     for (int f = 0; f < nr_face; ++f) {
       auto face = obj_.convertFace(tmesh, f);
       for (auto& v : face) {
-        mesh_.back().vertices.emplace_back(move(v));
+        mesh_.back().add_vertex(v);
         boxmin_ = glm::min(boxmin_, v.pos);
         boxmax_ = glm::max(boxmax_, v.pos);
       }
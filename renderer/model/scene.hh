@@ -34,6 +34,11 @@ class ObjSceneBase {
     virtual void deactivate() = 0;
     virtual Shader* get_shader() = 0;
 
+    // Approximate memory used by the scene, for the budgets of SceneCache.
+    // GPU memory is only used when the scene is activated.
+    virtual size_t gpu_bytes() const { return 0; }
+    virtual size_t host_bytes() const { return 0; }
+
     glm::vec3 get_range() const
     { return boxmax_ - boxmin_; }
 
@@ -7,6 +7,10 @@
 
 #pragma once
 
+#include <iterator>
+#include <limits>
+#include <list>
+#include <memory>
 #include <unordered_map>
 #include <string>
 
@@ -15,51 +19,105 @@
 namespace render {
 
 // Manage cache scenes, as well as the activating scenes.
+// Besides the current scene, the most recently used scenes stay activated
+// (resident on GPU) as long as they fit into the GPU budget, so that switching
+// to them costs nothing. Scenes that don't fit into the host budget are deleted.
+// The current scene is always kept, even if it alone exceeds a budget.
 class SceneCache {
   public:
     SceneCache() {}
-    ~SceneCache() {
-      for (auto& pair: cached_scenes_)
-        delete pair.second;
-    }
     SceneCache(const SceneCache&) = delete;
     SceneCache& operator =(const SceneCache&) = delete;
 
+    // Bytes of GPU memory for the resident scenes.
+    // Defaults to 0, i.e. only the current scene is activated.
+    void set_gpu_budget(size_t bytes) { gpu_budget_ = bytes; evict_(); }
+    // Bytes of host memory for all the cached scenes. Defaults to no limit.
+    void set_host_budget(size_t bytes) { host_budget_ = bytes; evict_(); }
+
+    bool contains(const std::string& name) const {
+      return cached_scenes_.count(name) > 0;
+    }
 
-    // will deactivate current scene, activate new scene
+    // Make the scene current, activating it if it's not resident.
     // Caller doesn't own the return pointer.
     ObjSceneBase* get(const std::string& name) {
       auto itr = cached_scenes_.find(name);
-      if (itr != cached_scenes_.end()) {
-        ObjSceneBase* new_scene = itr->second;
-        if (new_scene != scene_) {
-          scene_->deactivate();
-          new_scene->activate();
-          scene_ = new_scene;
-        }
-        return scene_;
+      if (itr == cached_scenes_.end())
+        return nullptr;
+      Entry& entry = itr->second;
+      lru_.splice(lru_.begin(), lru_, entry.lru_pos);
+      if (!entry.resident) {
+        entry.scene->activate();
+        entry.resident = true;
+        gpu_bytes_ += entry.gpu_bytes;
       }
-      return nullptr;
+      evict_();
+      return entry.scene.get();
     }
 
-    // ptr must be activated already.
-    // This will deactivate old scene, put the pair into cache
+    // ptr must be activated already, and becomes the current scene.
     // The caller transfer ownership to SceneCache.
     void put(const std::string& name, ObjSceneBase* ptr) {
-      if (scene_)
-        scene_->deactivate();
-      scene_ = ptr;
-      cached_scenes_[name] = ptr;
+      m_assert(!contains(name));
+      lru_.push_front(name);
+      Entry& entry = cached_scenes_[name];
+      entry.scene.reset(ptr);
+      entry.lru_pos = lru_.begin();
+      entry.resident = true;
+      entry.gpu_bytes = ptr->gpu_bytes();
+      entry.host_bytes = ptr->host_bytes();
+      gpu_bytes_ += entry.gpu_bytes;
+      host_bytes_ += entry.host_bytes;
+      evict_();
     }
 
+    size_t gpu_bytes() const { return gpu_bytes_; }
+    size_t host_bytes() const { return host_bytes_; }
+    size_t size() const { return cached_scenes_.size(); }
+
   private:
+    struct Entry {
+      std::unique_ptr<ObjSceneBase> scene;
+      std::list<std::string>::iterator lru_pos;
+      bool resident;
+      size_t gpu_bytes, host_bytes;
+    };
+
+    // Deactivate or delete the least recently used scenes until the budgets are met.
+    void evict_() {
+      if (lru_.empty())
+        return;
+      // scenes other than the current one (the front of lru_) are candidates
+      size_t budget = gpu_budget_ + cached_scenes_.at(lru_.front()).gpu_bytes;
+      for (auto itr = std::prev(lru_.end()); gpu_bytes_ > budget && itr != lru_.begin(); --itr) {
+        Entry& entry = cached_scenes_.at(*itr);
+        if (entry.resident) {
+          entry.scene->deactivate();
+          entry.resident = false;
+          gpu_bytes_ -= entry.gpu_bytes;
+        }
+      }
+      while (lru_.size() > 1 && host_bytes_ > host_budget_) {
+        auto itr = cached_scenes_.find(lru_.back());
+        Entry& entry = itr->second;
+        if (entry.resident)
+          gpu_bytes_ -= entry.gpu_bytes;
+        host_bytes_ -= entry.host_bytes;
+        lru_.pop_back();
+        cached_scenes_.erase(itr);
+      }
+    }
+
     // cache previously loaded scenes
     // This hash owns all the pointers.
-    std::unordered_map<std::string, ObjSceneBase*> cached_scenes_;
+    std::unordered_map<std::string, Entry> cached_scenes_;
+    // names of the cached scenes, most recently used first
+    std::list<std::string> lru_;
 
-    // The current scene
-    ObjSceneBase* scene_ = nullptr;  // doesn't own this pointer. Only this scene should be activated.
+    size_t gpu_budget_ = 0, host_budget_ = std::numeric_limits<size_t>::max();
+    // total bytes of the resident scenes, and of all scenes
+    size_t gpu_bytes_ = 0, host_bytes_ = 0;
 };
 
 }
-
@@ -0,0 +1,179 @@
+// Copyright 2017-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the license found in the
+// LICENSE file in the root directory of this source tree.
+//File: texturestore.cc
+
+#include "texturestore.hh"
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <unistd.h>
+
+#include "lib/debugutils.hh"
+#include "lib/imgproc.hh"
+#include "lib/mappedfile.hh"
+#include "lib/strutils.hh"
+
+using namespace std;
+
+namespace {
+
+const char CACHE_MAGIC[8] = {'H', '3', 'D', 'T', 'E', 'X', '0', '1'};
+
+string canonical_path(const string& filename) {
+  char buf[PATH_MAX];
+  if (realpath(filename.c_str(), buf) == nullptr)
+    return filename;
+  return buf;
+}
+
+// average of 2x2 blocks. The last row/column is repeated for odd sizes.
+Matuc halve(const Matuc& src) {
+  int rows = std::max(src.rows() / 2, 1), cols = std::max(src.cols() / 2, 1),
+      channels = src.channels();
+  Matuc dst{rows, cols, channels};
+  REP(i, rows) {
+    const unsigned char* r0 = src.ptr(std::min(2 * i, src.rows() - 1));
+    const unsigned char* r1 = src.ptr(std::min(2 * i + 1, src.rows() - 1));
+    unsigned char* out = dst.ptr(i);
+    REP(j, cols) {
+      int c0 = std::min(2 * j, src.cols() - 1) * channels,
+          c1 = std::min(2 * j + 1, src.cols() - 1) * channels;
+      REP(k, channels)
+        *(out++) = (r0[c0 + k] + r0[c1 + k] + r1[c0 + k] + r1[c1 + k] + 2) / 4;
+    }
+  }
+  return dst;
+}
+
+string get_cache_dir() {
+  const char* dir = getenv("HOUSE3D_TEXTURE_CACHE");
+  return dir ? dir : "";
+}
+
+// Read once when the library is loaded, because textures are decoded in worker threads,
+// where getenv() would race with the setenv() of SoftwareEGLContext.
+const string CACHE_DIR = get_cache_dir();
+
+// The file in the cache directory of a texture, or "" if caching is disabled.
+string cache_file_name(const string& path, int max_size) {
+  if (CACHE_DIR.empty())
+    return "";
+  return ssprintf("%s/%016zx_%d.tex", CACHE_DIR.c_str(), hash<string>()(path), max_size);
+}
+
+// The cache file starts with the magic, the source path and the shape of the image.
+bool read_cache(const string& fname, const string& path, Matuc* image) {
+  ifstream in(fname, ios::binary);
+  char magic[sizeof(CACHE_MAGIC)];
+  uint32_t path_len;
+  if (!in.read(magic, sizeof(magic)) || memcmp(magic, CACHE_MAGIC, sizeof(magic)) != 0 ||
+      !in.read(reinterpret_cast<char*>(&path_len), sizeof(path_len)))
+    return false;
+  string cached_path(path_len, '\0');
+  int32_t shape[3];
+  if (!in.read(&cached_path[0], path_len) || cached_path != path ||
+      !in.read(reinterpret_cast<char*>(shape), sizeof(shape)))
+    return false;
+  Matuc ret{shape[0], shape[1], shape[2]};
+  if (!in.read(reinterpret_cast<char*>(ret.ptr()), ret.elements()))
+    return false;
+  *image = ret;
+  return true;
+}
+
+void write_cache(const string& fname, const string& path, const Matuc& image) {
+  // write to a temporary file first, so other processes never see a partial file
+  string tmp = ssprintf("%s.%d", fname.c_str(), getpid());
+  {
+    ofstream out(tmp, ios::binary);
+    uint32_t path_len = path.size();
+    int32_t shape[3] = {image.rows(), image.cols(), image.channels()};
+    out.write(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    out.write(reinterpret_cast<const char*>(&path_len), sizeof(path_len));
+    out.write(path.data(), path_len);
+    out.write(reinterpret_cast<const char*>(shape), sizeof(shape));
+    out.write(reinterpret_cast<const char*>(image.ptr()), image.elements());
+    if (!out) {
+      print_debug("Failed to write texture cache %s\n", tmp.c_str());
+      unlink(tmp.c_str());
+      return;
+    }
+  }
+  rename(tmp.c_str(), fname.c_str());
+}
+
+Matuc decode(const string& path, int max_size) {
+  string cache_file = cache_file_name(path, max_size);
+  Matuc image;
+  if (cache_file.size() && is_newer_file(cache_file, path) &&
+      read_cache(cache_file, path, &image))
+    return image;
+
+  image = read_img(path.c_str());
+  vflip(image);
+  if (max_size > 0)
+    while (image.width() > max_size || image.height() > max_size)
+      image = halve(image);
+  if (cache_file.size())
+    write_cache(cache_file, path, image);
+  return image;
+}
+
+}
+
+namespace render {
+
+mutex TextureStore::mutex_;
+unordered_map<string, weak_ptr<const Matuc>> TextureStore::images_;
+
+shared_ptr<const Matuc> TextureStore::get(const string& filename, int max_size) {
+  string path = canonical_path(filename);
+  string key = max_size > 0 ? ssprintf("%s@%d", path.c_str(), max_size) : path;
+  {
+    lock_guard<mutex> lg(mutex_);
+    auto itr = images_.find(key);
+    if (itr != images_.end()) {
+      auto ret = itr->second.lock();
+      if (ret)
+        return ret;
+    }
+  }
+
+  // decode outside of the lock, so different files are decoded in parallel
+  shared_ptr<Matuc> image = make_shared<Matuc>(decode(path, max_size));
+
+  lock_guard<mutex> lg(mutex_);
+  auto& entry = images_[key];
+  // another thread may have decoded it in the meantime
+  auto ret = entry.lock();
+  if (ret)
+    return ret;
+  entry = image;
+  // drop the entries of freed textures once in a while
+  if (images_.size() % 256 == 0) {
+    for (auto itr = images_.begin(); itr != images_.end(); ) {
+      if (itr->second.expired())
+        itr = images_.erase(itr);
+      else
+        ++itr;
+    }
+  }
+  return image;
+}
+
+size_t TextureStore::size() {
+  lock_guard<mutex> lg(mutex_);
+  size_t ret = 0;
+  for (auto& p : images_)
+    ret += !p.second.expired();
+  return ret;
+}
+
+}
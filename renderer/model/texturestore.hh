@@ -0,0 +1,40 @@
+// Copyright 2017-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the license found in the
+// LICENSE file in the root directory of this source tree.
+//File: texturestore.hh
+
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "lib/mat.h"
+
+namespace render {
+
+// Process-wide store of decoded textures, keyed by the canonical path of the file.
+// A texture is decoded once and shared by all the TextureRegistry that use it,
+// and is freed when the last of them is gone. Thread-safe.
+//
+// If the environment variable HOUSE3D_TEXTURE_CACHE is set to a directory when the
+// library is loaded, decoded (and downscaled) textures are also cached there as raw pixels,
+// so later processes don't need to decode them again.
+class TextureStore {
+  public:
+    // The decoded image of the file, flipped vertically for OpenGL.
+    // If max_size > 0, the image is halved until its width and height are at most max_size.
+    static std::shared_ptr<const Matuc> get(const std::string& filename, int max_size = 0);
+
+    // number of textures alive
+    static size_t size();
+
+  private:
+    static std::mutex mutex_;
+    static std::unordered_map<std::string, std::weak_ptr<const Matuc>> images_;
+};
+
+}
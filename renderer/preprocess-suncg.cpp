@@ -0,0 +1,37 @@
+// Copyright 2017-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the license found in the
+// LICENSE file in the root directory of this source tree.
+//File: preprocess-suncg.cpp
+
+// Parse SUNCG houses and save them as binary scene files,
+// which are loaded by SUNCGRenderAPI much faster than the obj.
+// Usage: ./preprocess-suncg.bin ModelCategoryMapping.csv colormap.csv house1.obj [house2.obj ...]
+// house.h3d will be written next to each house.obj.
+
+#include <iostream>
+
+#include "lib/timer.hh"
+#include "suncg/scene.hh"
+
+using namespace render;
+using namespace std;
+
+int main(int argc, char* argv[]) {
+  if (argc < 4) {
+    cerr << "Usage: " << argv[0]
+      << " ModelCategoryMapping.csv colormap.csv house.obj [house.obj ...]" << endl;
+    return 1;
+  }
+  for (int i = 3; i < argc; ++i) {
+    Timer timer;
+    string obj_file = argv[i];
+    string scene_file = SUNCGScene::scene_file_name(obj_file);
+    {
+      SUNCGScene scene{obj_file, argv[1], argv[2]};
+      scene.save(scene_file);
+    }
+    cout << obj_file << " -> " << scene_file << " in " << timer.duration() << " seconds." << endl;
+  }
+}
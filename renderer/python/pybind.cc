@@ -7,6 +7,8 @@
 
 #include <pybind11/pybind11.h>
 #include <pybind11/operators.h>
+#include <pybind11/stl.h>
+#include <pybind11/numpy.h>
 
 
 #include "suncg/render.hh"
@@ -21,20 +23,140 @@ namespace py = pybind11;
 
 namespace {
 //TotalTimerGlobalGuard TGGG;
+
+// Check that `arr` is a writable, C-contiguous array of type T and of the given shape,
+// and return its data pointer.
+template <typename T>
+T* get_output_ptr(py::array& arr, const std::vector<int>& shape) {
+  if (!py::isinstance<py::array_t<T>>(arr))
+    throw py::type_error(ssprintf("Output array must have dtype %s!",
+          std::is_same<T, float>::value ? "float32" : "uint8"));
+  if (!arr.writeable())
+    throw py::value_error("Output array must be writable!");
+  if (!(arr.flags() & py::array::c_style))
+    throw py::value_error("Output array must be C-contiguous!");
+  bool same_shape = arr.ndim() == (int)shape.size();
+  for (int i = 0; same_shape && i < (int)shape.size(); ++i)
+    same_shape = arr.shape(i) == shape[i];
+  if (!same_shape) {
+    string expected;
+    for (int k : shape)
+      expected += to_string(k) + ",";
+    throw py::value_error(ssprintf("Output array must have shape (%s)!", expected.c_str()));
+  }
+  return static_cast<T*>(arr.mutable_data());
+}
+
+// Shape of the image rendered in the current mode:
+// (h, w) for DEPTH_FLOAT, and (h, w, c) otherwise.
+template <typename API>
+std::vector<int> image_shape(const API& api) {
+  Geometry geo = api.resolution();
+  if (api.getMode() == SUNCGScene::RenderMode::DEPTH_FLOAT)
+    return {geo.h, geo.w};
+  return {geo.h, geo.w, api.numChannels()};
+}
+
+// Render an image of the current mode: a Mat32f in DEPTH_FLOAT mode, and a Matuc otherwise.
+template <typename API>
+py::object render_image(API& api) {
+  if (api.getMode() == SUNCGScene::RenderMode::DEPTH_FLOAT)
+    return py::cast(api.renderFloat());
+  return py::cast(api.render());
+}
+
+// Render into an array of image_shape()
+template <typename API>
+void render_to_array(API& api, py::array out) {
+  auto shape = image_shape(api);
+  if (api.getMode() == SUNCGScene::RenderMode::DEPTH_FLOAT)
+    api.render(get_output_ptr<float>(out, shape));
+  else
+    api.render(get_output_ptr<unsigned char>(out, shape));
+}
+
+// Render into batch[index], where batch is an array of (N, ) + image_shape()
+template <typename API>
+void render_to_batch(API& api, py::array batch, int index) {
+  auto shape = image_shape(api);
+  if (batch.ndim() != (int)shape.size() + 1 || index < 0 || index >= batch.shape(0))
+    throw py::index_error(ssprintf("Cannot write to index %d of the batch!", index));
+  size_t offset = (size_t)index * api.resolution().area() * api.numChannels();
+  shape.insert(shape.begin(), batch.shape(0));
+  if (api.getMode() == SUNCGScene::RenderMode::DEPTH_FLOAT)
+    api.render(get_output_ptr<float>(batch, shape) + offset);
+  else
+    api.render(get_output_ptr<unsigned char>(batch, shape) + offset);
+}
+
+// Render all cameras into `out`, an array of (N, ) + image_shape()
+template <typename API>
+void render_batch_to_array(API& api, const std::vector<Camera>& cameras, py::array out) {
+  auto shape = image_shape(api);
+  shape.insert(shape.begin(), cameras.size());
+  if (api.getMode() == SUNCGScene::RenderMode::DEPTH_FLOAT)
+    api.renderBatch(cameras, get_output_ptr<float>(out, shape));
+  else
+    api.renderBatch(cameras, get_output_ptr<unsigned char>(out, shape));
+}
+
+// Render all cameras into a new array of (N, ) + image_shape()
+template <typename API>
+py::array render_batch(API& api, const std::vector<Camera>& cameras) {
+  auto shape = image_shape(api);
+  shape.insert(shape.begin(), cameras.size());
+  py::array out;
+  if (api.getMode() == SUNCGScene::RenderMode::DEPTH_FLOAT)
+    out = py::array_t<float>(shape);
+  else
+    out = py::array_t<unsigned char>(shape);
+  render_batch_to_array(api, cameras, out);
+  return out;
+}
+
 }
 
 using namespace pybind11::literals;
 PYBIND11_MODULE(objrender, m) {
+  // registered before its use as default arguments
+  py::enum_<GLBackend>(m, "GLBackend")
+    .value("AUTO", GLBackend::AUTO)
+    .value("GLX", GLBackend::GLX)
+    .value("EGL", GLBackend::EGL)
+    .value("SOFTWARE", GLBackend::SOFTWARE);
+
   py::class_<SUNCGRenderAPI>(m, "RenderAPI")
     // device defaults to 0
-    .def(py::init<int, int, int>(), "Initialize", "w"_a, "h"_a, "device"_a=0)
+    .def(py::init([](int w, int h, int device, GLBackend backend, int num_threads) {
+          return new SUNCGRenderAPI{w, h, device, nullptr, backend, num_threads};
+        }), "Initialize", "w"_a, "h"_a, "device"_a=0,
+        "backend"_a=GLBackend::AUTO, "num_threads"_a=0)
     .def("printContextInfo", &SUNCGRenderAPI::printContextInfo)
     .def("getCamera", &SUNCGRenderAPI::getCamera, py::return_value_policy::reference)
     .def("setMode", &SUNCGRenderAPI::setMode)
+    .def("getMode", &SUNCGRenderAPI::getMode)
+    .def("setVertexFormat", &SUNCGRenderAPI::setVertexFormat)
+    .def("setMaxTextureSize", &SUNCGRenderAPI::setMaxTextureSize)
+    .def("getMaxTextureSize", &SUNCGRenderAPI::getMaxTextureSize)
     .def("loadSceneSUNCG", &SUNCGRenderAPI::loadScene)
     .def("loadScene", &SUNCGRenderAPI::loadScene)
+    .def("prefetchScene", &SUNCGRenderAPI::prefetchScene)
+    .def("setGPUMemoryBudget", &SUNCGRenderAPI::setGPUMemoryBudget, "bytes"_a)
+    .def("setHostMemoryBudget", &SUNCGRenderAPI::setHostMemoryBudget, "bytes"_a)
+    .def("setReleaseHostData", &SUNCGRenderAPI::setReleaseHostData)
+    .def("setCPURasterizer", &SUNCGRenderAPI::setCPURasterizer, "enable"_a, "num_threads"_a=0)
     .def("resolution", &SUNCGRenderAPI::resolution)
-    .def("render", &SUNCGRenderAPI::render)
+    .def("render", &render_image<SUNCGRenderAPI>)
+    // render into a preallocated numpy array
+    .def("render", &render_to_array<SUNCGRenderAPI>, "out"_a)
+    .def("render", &render_to_batch<SUNCGRenderAPI>, "out"_a, "index"_a)
+    .def("numChannels", &SUNCGRenderAPI::numChannels)
+    .def("renderBatch", &render_batch<SUNCGRenderAPI>, "cameras"_a)
+    .def("renderBatch", &render_batch_to_array<SUNCGRenderAPI>, "cameras"_a, "out"_a)
+    .def("renderMulti", &SUNCGRenderAPI::renderMulti)
+    .def("renderAsync", &SUNCGRenderAPI::renderAsync)
+    .def("fetch", &SUNCGRenderAPI::fetch)
+    .def("numPendingFrames", &SUNCGRenderAPI::numPendingFrames)
     .def("renderCubeMap", &SUNCGRenderAPI::renderCubeMap)
     .def("getNameFromInstanceColor", &SUNCGRenderAPI::getNameFromInstanceColor)
       ;
@@ -42,19 +164,58 @@ PYBIND11_MODULE(objrender, m) {
 
   py::class_<SUNCGRenderAPIThread>(m, "RenderAPIThread")
     // device defaults to 0
-    .def(py::init<int, int, int>(), "Initialize", "w"_a, "h"_a, "device"_a=0)
+    // with `share`, scenes loaded by both are uploaded to GPU once
+    .def(py::init<int, int, int, const SUNCGRenderAPIThread*, GLBackend, int>(), "Initialize",
+        "w"_a, "h"_a, "device"_a=0, "share"_a=nullptr,
+        "backend"_a=GLBackend::AUTO, "num_threads"_a=0)
     .def("getCamera", &SUNCGRenderAPIThread::getCamera, py::return_value_policy::reference)
     .def("printContextInfo", &SUNCGRenderAPIThread::printContextInfo)
     .def("setMode", &SUNCGRenderAPIThread::setMode)
+    .def("getMode", &SUNCGRenderAPIThread::getMode)
+    .def("setVertexFormat", &SUNCGRenderAPIThread::setVertexFormat)
+    .def("setMaxTextureSize", &SUNCGRenderAPIThread::setMaxTextureSize)
+    .def("getMaxTextureSize", &SUNCGRenderAPIThread::getMaxTextureSize)
     .def("loadSceneSUNCG", &SUNCGRenderAPIThread::loadScene)
     .def("loadScene", &SUNCGRenderAPIThread::loadScene)
+    .def("prefetchScene", &SUNCGRenderAPIThread::prefetchScene)
+    .def("setGPUMemoryBudget", &SUNCGRenderAPIThread::setGPUMemoryBudget, "bytes"_a)
+    .def("setHostMemoryBudget", &SUNCGRenderAPIThread::setHostMemoryBudget, "bytes"_a)
+    .def("setReleaseHostData", &SUNCGRenderAPIThread::setReleaseHostData)
+    .def("setCPURasterizer", &SUNCGRenderAPIThread::setCPURasterizer,
+        "enable"_a, "num_threads"_a=0)
     .def("resolution", &SUNCGRenderAPIThread::resolution)
-    .def("render", &SUNCGRenderAPIThread::render)
+    .def("render", &render_image<SUNCGRenderAPIThread>)
+    // render into a preallocated numpy array
+    .def("render", &render_to_array<SUNCGRenderAPIThread>, "out"_a)
+    .def("render", &render_to_batch<SUNCGRenderAPIThread>, "out"_a, "index"_a)
+    .def("numChannels", &SUNCGRenderAPIThread::numChannels)
+    .def("renderBatch", &render_batch<SUNCGRenderAPIThread>, "cameras"_a)
+    .def("renderBatch", &render_batch_to_array<SUNCGRenderAPIThread>, "cameras"_a, "out"_a)
+    .def("renderMulti", &SUNCGRenderAPIThread::renderMulti)
+    // returns a FrameFuture
+    .def("renderAsync", &SUNCGRenderAPIThread::renderAsync)
+    // the queue of frames is only touched with the GIL held
+    .def("fetch", [](SUNCGRenderAPIThread& api) {
+          auto frame = api.fetchFuture();
+          py::gil_scoped_release release;
+          return frame.get();
+        })
+    .def("numPendingFrames", &SUNCGRenderAPIThread::numPendingFrames)
     .def("renderCubeMap", &SUNCGRenderAPIThread::renderCubeMap)
     .def("getNameFromInstanceColor", &SUNCGRenderAPIThread::getNameFromInstanceColor)
       ;
 
+  // A frame being rendered by RenderAPIThread.renderAsync()
+  py::class_<std::shared_future<Matuc>>(m, "FrameFuture")
+    // wait for the frame and return it
+    .def("get", [](const std::shared_future<Matuc>& f) { return f.get(); },
+        py::call_guard<py::gil_scoped_release>())
+    .def("ready", [](const std::shared_future<Matuc>& f) {
+          return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        });
+
   auto camera = py::class_<Camera>(m, "Camera")
+    .def(py::init<glm::vec3, float, float>(), "pos"_a, "yaw"_a=-90.f, "pitch"_a=0.f)
     .def("shift", &Camera::shift)
     .def("turn", &Camera::turn)
     .def("updateDirection", &Camera::updateDirection)
@@ -78,8 +239,14 @@ PYBIND11_MODULE(objrender, m) {
     .value("DEPTH", SUNCGScene::RenderMode::DEPTH)
     .value("INSTANCE", SUNCGScene::RenderMode::INSTANCE)
     .value("INVDEPTH", SUNCGScene::RenderMode::INVDEPTH)
+    .value("DEPTH_FLOAT", SUNCGScene::RenderMode::DEPTH_FLOAT)
     .export_values();
 
+  py::enum_<VertexFormat>(m, "VertexFormat")
+    .value("FLOAT", VertexFormat::FLOAT)
+    .value("COMPACT", VertexFormat::COMPACT)
+    .value("COMPACT_NO_TEXCOORD", VertexFormat::COMPACT_NO_TEXCOORD);
+
   py::enum_<Camera::Movement>(camera, "Movement")
     .value("Forward", Camera::Movement::FORWARD)
     .value("Backward", Camera::Movement::BACKWARD)
@@ -121,4 +288,23 @@ PYBIND11_MODULE(objrender, m) {
           {sizeof(unsigned char) * m.cols() * m.channels(),
           sizeof(unsigned char) * m.channels(), sizeof(unsigned char)});
       });
+
+  // 1-channel float images are 2D arrays of (h, w)
+  py::class_<Mat32f>(m, "MatFloat", py::buffer_protocol()).def_buffer([](Mat32f &m) -> py::buffer_info {
+      if (m.channels() == 1)
+        return py::buffer_info(m.ptr(),
+            sizeof(float),
+            py::format_descriptor<float>::format(),
+            2,
+            {(unsigned long)m.rows(), (unsigned long)m.cols()},
+            {sizeof(float) * m.cols(), sizeof(float)});
+      return py::buffer_info(m.ptr(),
+          sizeof(float),
+          py::format_descriptor<float>::format(),
+          3,
+          {(unsigned long)m.rows(), (unsigned long)m.cols(),
+          (unsigned long)m.channels()},
+          {sizeof(float) * m.cols() * m.channels(),
+          sizeof(float) * m.channels(), sizeof(float)});
+      });
 }
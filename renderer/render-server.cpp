@@ -0,0 +1,93 @@
+// Copyright 2017-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the license found in the
+// LICENSE file in the root directory of this source tree.
+//File: render-server.cpp
+
+// Render SUNCG scenes for many client processes on one node.
+// Usage: ./render-server.bin [options] /path/to/socket
+//   -w width, -h height      resolution of all the frames (default 120x90)
+//   -d 0,1,...               GPUs to use (default 0)
+//   -c num_contexts          GL contexts, spread over the GPUs (default: one per GPU)
+//   -g gpu_budget_mb         GPU memory of each context for the loaded scenes (default: no limit)
+//   -s num_slots             frames each client can have in flight (default 4)
+//   -b glx|egl|software      kind of the GL contexts (default: GLX if DISPLAY is set, EGL otherwise)
+//   -t num_threads           rasterizer threads of the software backend (default: one per CPU)
+// Connect with House3D.renderclient.RenderClient, which can be used in place of RenderAPI.
+
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+
+#include "suncg/server.hh"
+#include "lib/strutils.hh"
+
+using namespace render;
+using namespace std;
+
+namespace {
+RenderServer* the_server = nullptr;
+
+void handle_signal(int) {
+  if (the_server)
+    the_server->stop();
+}
+}
+
+int main(int argc, char* argv[]) {
+  RenderServer::Options options;
+  bool has_num_contexts = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "w:h:d:c:g:s:b:t:")) != -1) {
+    switch (opt) {
+      case 'w': options.w = stoi(optarg); break;
+      case 'h': options.h = stoi(optarg); break;
+      case 'd':
+        options.devices.clear();
+        for (auto& s : strsplit(optarg, ","))
+          options.devices.push_back(stoi(s));
+        break;
+      case 'c': options.num_contexts = stoi(optarg); has_num_contexts = true; break;
+      case 'g': options.gpu_budget = stoull(optarg) << 20; break;
+      case 's': options.num_slots = stoi(optarg); break;
+      case 'b':
+        if (!strcmp(optarg, "glx")) {
+          options.backend = GLBackend::GLX;
+        } else if (!strcmp(optarg, "egl")) {
+          options.backend = GLBackend::EGL;
+        } else if (!strcmp(optarg, "software")) {
+          options.backend = GLBackend::SOFTWARE;
+        } else {
+          cerr << "Unknown backend " << optarg << endl;
+          return 1;
+        }
+        break;
+      case 't': options.num_threads = stoi(optarg); break;
+      default:
+        cerr << "Usage: " << argv[0]
+          << " [-w width] [-h height] [-d devices] [-c num_contexts] [-g gpu_budget_mb]"
+          << " [-s num_slots] [-b glx|egl|software] [-t num_threads] /path/to/socket" << endl;
+        return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    cerr << "Usage: " << argv[0] << " [options] /path/to/socket" << endl;
+    return 1;
+  }
+  if (!has_num_contexts)
+    options.num_contexts = options.devices.size();
+
+  RenderServer s{argv[optind], options};
+  the_server = &s;
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handle_signal;
+  // not SA_RESTART, so that poll() is interrupted
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+  cout << "Serving " << options.num_contexts << " contexts at " << argv[optind] << endl;
+  s.run();
+  the_server = nullptr;
+}
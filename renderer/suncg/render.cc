@@ -7,13 +7,205 @@
 
 #include "render.hh"
 
+#include <stdexcept>
+#include <algorithm>
+
 #include "gl/fbScope.hh"
-#include "lib/imgproc.hh"
+#include "lib/mappedfile.hh"
+#include "lib/strutils.hh"
+
+using namespace std;
+
+namespace {
+
+// Build an inactive scene. Does not need the GL context.
+// Its GPU objects are shared in `group` by the scenes built with the same arguments.
+render::SUNCGScene* build_scene(
+    const string& obj_file, const string& model_category_file,
+    const string& semantic_label_file, render::VertexFormat vertex_format,
+    int max_texture_size, shared_ptr<render::ShareGroup> group) {
+  using render::SUNCGScene;
+  string scene_file = SUNCGScene::scene_file_name(obj_file);
+  SUNCGScene* ret;
+  if (SUNCGScene::is_scene_file(obj_file)) {
+    ret = SUNCGScene::load(obj_file, model_category_file, semantic_label_file,
+        SUNCGScene::DEFAULT_MIN_DEPTH, vertex_format, max_texture_size);
+  } else if (is_newer_file(scene_file, obj_file) && SUNCGScene::is_scene_file(scene_file)) {
+    // use the preprocessed scene, see preprocess-suncg.cpp
+    ret = SUNCGScene::load(scene_file, model_category_file, semantic_label_file,
+        SUNCGScene::DEFAULT_MIN_DEPTH, vertex_format, max_texture_size);
+  } else {
+    ret = new SUNCGScene{obj_file, model_category_file, semantic_label_file,
+        SUNCGScene::DEFAULT_MIN_DEPTH, vertex_format, max_texture_size};
+  }
+  ret->set_share_group(std::move(group), ssprintf("%s:%d:%d",
+        obj_file.c_str(), static_cast<int>(vertex_format), max_texture_size));
+  return ret;
+}
+
+}
 
 namespace render {
 
 
 Matuc SUNCGRenderAPI::render() {
+  if (getMode() == SUNCGScene::RenderMode::DEPTH_FLOAT)
+    throw std::runtime_error("Use renderFloat() to render in DEPTH_FLOAT mode!");
+  Matuc ret{geo_.h, geo_.w, numChannels()};
+  render(ret.ptr());
+  return ret;
+}
+
+
+Mat32f SUNCGRenderAPI::renderFloat() {
+  if (getMode() != SUNCGScene::RenderMode::DEPTH_FLOAT)
+    throw std::runtime_error("renderFloat() only works in DEPTH_FLOAT mode!");
+  Mat32f ret{geo_.h, geo_.w, 1};
+  render(ret.ptr());
+  return ret;
+}
+
+
+void SUNCGRenderAPI::render(void* dst) {
+  render(*camera_, dst);
+}
+
+
+void SUNCGRenderAPI::render(const Camera& camera, void* dst) {
+  auto mode = getMode();
+  if (use_rasterizer_()) {
+    glm::mat4 projection = camera.getCameraMatrix(geo_);
+    if (mode == SUNCGScene::RenderMode::DEPTH) {
+      depth_buf_.resize(geo_.area() * 3);
+      scene_->rasterize(*rasterizer_, projection, geo_, depth_buf_.data());
+      convert_depth_(depth_buf_.data(), static_cast<unsigned char*>(dst), geo_.area());
+    } else {
+      scene_->rasterize(*rasterizer_, projection, geo_, dst);
+    }
+    return;
+  }
+  if (mode == SUNCGScene::RenderMode::DEPTH_FLOAT && !depth_fb_)
+    depth_fb_.reset(new Framebuffer{geo_, 1, GL_R32F});
+  FramebufferScope fb{mode == SUNCGScene::RenderMode::DEPTH_FLOAT ? *depth_fb_ : fb_};
+  Shader* shader_ = scene_->get_shader();
+  shader_->use();
+  shader_->setMat4("projection", camera.getCameraMatrix(geo_));
+  shader_->setVec3("eye", camera.pos);
+
+  scene_->draw();
+
+  if (mode == SUNCGScene::RenderMode::DEPTH) {
+    depth_buf_.resize(geo_.area() * 3);
+    fb.capture(depth_buf_.data());
+    convert_depth_(depth_buf_.data(), static_cast<unsigned char*>(dst), geo_.area());
+  } else {
+    fb.capture(dst);
+  }
+}
+
+
+void SUNCGRenderAPI::renderBatch(const std::vector<Camera>& cameras, void* dst) {
+  bool is_float = getMode() == SUNCGScene::RenderMode::DEPTH_FLOAT;
+  if (use_rasterizer_()) {
+    // no readback to amortize on CPU
+    size_t image_bytes = geo_.area() * numChannels() * (is_float ? sizeof(float) : 1);
+    for (size_t i = 0; i < cameras.size(); ++i)
+      render(cameras[i], static_cast<unsigned char*>(dst) + i * image_bytes);
+    return;
+  }
+  GLint max_size = 0;
+  glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &max_size);
+  int max_tiles = max_size / geo_.h;
+  int num_cameras = cameras.size();
+  int num_tiles = std::min(max_tiles, num_cameras);
+  if (num_tiles == 0)
+    return;
+  if (!batch_fb_ || batch_fb_->size().h < num_tiles * geo_.h ||
+      batch_fb_->is_float() != is_float) {
+    batch_fb_.reset(new Framebuffer{
+        Geometry{geo_.w, num_tiles * geo_.h}, 1, GLenum(is_float ? GL_R32F : GL_RGBA8)});
+  }
+
+  size_t image_bytes = geo_.area() * numChannels() * (is_float ? sizeof(float) : 1);
+  unsigned char* ptr = static_cast<unsigned char*>(dst);
+  // split into several batches if cameras don't fit into the largest framebuffer
+  for (int start = 0; start < num_cameras; start += num_tiles) {
+    int num = std::min(num_tiles, num_cameras - start);
+    render_tiles_(&cameras[start], num, ptr + start * image_bytes);
+  }
+}
+
+
+void SUNCGRenderAPI::render_tiles_(const Camera* cameras, int num, void* dst) {
+  int total_tiles = batch_fb_->size().h / geo_.h;
+  FramebufferScope fb{*batch_fb_};
+  scene_->get_shader()->use();
+
+  // Camera i is drawn to the i-th tile from the top,
+  // so the flipped readback has all images in order.
+  glEnable(GL_SCISSOR_TEST);
+  for (int i = 0; i < num; ++i)
+    draw_tile_(cameras[i], 0, (total_tiles - 1 - i) * geo_.h);
+  glDisable(GL_SCISSOR_TEST);
+  glViewport(0, 0, geo_.w, geo_.h);
+
+  if (getMode() == SUNCGScene::RenderMode::DEPTH) {
+    depth_buf_.resize(geo_.area() * num * 3);
+    fb.capture(depth_buf_.data(), 0, num * geo_.h);
+    convert_depth_(depth_buf_.data(), static_cast<unsigned char*>(dst), geo_.area() * num);
+  } else {
+    fb.capture(dst, 0, num * geo_.h);
+  }
+}
+
+
+void SUNCGRenderAPI::draw_tile_(const Camera& camera, int x, int y) {
+  glViewport(x, y, geo_.w, geo_.h);
+  // limit glClear to the tile
+  glScissor(x, y, geo_.w, geo_.h);
+  Shader* shader_ = scene_->get_shader();
+  shader_->setMat4("projection", camera.getCameraMatrix(geo_));
+  shader_->setVec3("eye", camera.pos);
+  scene_->draw();
+}
+
+
+std::vector<Matuc> SUNCGRenderAPI::renderMulti(
+    const std::vector<SUNCGScene::RenderMode>& modes) {
+  if (!multi_fb_)
+    multi_fb_.reset(new Framebuffer{geo_, SUNCGScene::NUM_COLOR_RENDER_MODES});
+  std::vector<bool> enabled(SUNCGScene::NUM_COLOR_RENDER_MODES, false);
+  for (auto m : modes) {
+    if (m == SUNCGScene::RenderMode::DEPTH_FLOAT)
+      throw std::runtime_error("renderMulti() does not support DEPTH_FLOAT mode!");
+    enabled[static_cast<int>(m)] = true;
+  }
+
+  FramebufferScope fb{*multi_fb_};
+  multi_fb_->setDrawBuffers(enabled);
+  Shader* shader_ = scene_->get_multi_output_shader();
+  shader_->use();
+  shader_->setMat4("projection", camera_->getCameraMatrix(geo_));
+  shader_->setVec3("eye", camera_->pos);
+
+  scene_->draw_all_modes();
+
+  std::vector<Matuc> ret;
+  for (auto m : modes)
+    ret.emplace_back(postprocess_(fb.capture(static_cast<int>(m)), m));
+  return ret;
+}
+
+
+void SUNCGRenderAPI::renderAsync() {
+  if (!pbo_ring_)
+    pbo_ring_.reset(new PixelBufferRing{geo_, ASYNC_QUEUE_SIZE});
+  if (pbo_ring_->full())
+    throw std::runtime_error(ssprintf(
+          "Cannot have more than %d frames in flight. Call fetch() first!", ASYNC_QUEUE_SIZE));
+  if (getMode() == SUNCGScene::RenderMode::DEPTH_FLOAT)
+    throw std::runtime_error("renderAsync() does not support DEPTH_FLOAT mode!");
+
   FramebufferScope fb{fb_};
   Shader* shader_ = scene_->get_shader();
   shader_->use();
@@ -22,70 +214,129 @@ Matuc SUNCGRenderAPI::render() {
 
   scene_->draw();
 
-  auto buf = fb.capture();
-  if (scene_->get_mode() == SUNCGScene::RenderMode::DEPTH) {
-    Matuc ret(geo_.h, geo_.w, 2);
-    fill(ret, (unsigned char)0);
-    for (int i = 0; i < geo_.h; ++i) {
-      unsigned char* destptr = ret.ptr(i);
-      for (int j = 0; j < geo_.w; ++j) {
-        unsigned char* ptr = buf.ptr(i, j);
-        if (ptr[0] == ptr[1] and ptr[1] == ptr[2])
-          destptr[j * 2] = ptr[0];
-        else
-          destptr[j * 2 + 1] = 255;
-      }
-    }
-    return ret;
-  } else {
+  pbo_ring_->startCapture(fb_);
+  async_modes_.push_back(scene_->get_mode());
+}
+
+
+Matuc SUNCGRenderAPI::fetch() {
+  if (async_modes_.empty())
+    throw std::runtime_error("No frames to fetch. Call renderAsync() first!");
+  auto mode = async_modes_.front();
+  async_modes_.pop_front();
+  return postprocess_(pbo_ring_->finishCapture(), mode);
+}
+
+
+Matuc SUNCGRenderAPI::postprocess_(Matuc buf, SUNCGScene::RenderMode mode) {
+  if (mode != SUNCGScene::RenderMode::DEPTH)
     return buf;
+  Matuc ret(geo_.h, geo_.w, 2);
+  convert_depth_(buf.ptr(), ret.ptr(), geo_.area());
+  return ret;
+}
+
+
+void SUNCGRenderAPI::convert_depth_(
+    const unsigned char* src, unsigned char* dst, int npixels) {
+  for (int i = 0; i < npixels; ++i) {
+    const unsigned char* ptr = src + i * 3;
+    if (ptr[0] == ptr[1] and ptr[1] == ptr[2]) {
+      dst[i * 2] = ptr[0];
+      dst[i * 2 + 1] = 0;
+    } else {
+      dst[i * 2] = 0;
+      dst[i * 2 + 1] = 255;
+    }
   }
 }
 
 
 Matuc SUNCGRenderAPI::renderCubeMap() {
-  float prev_fov = camera_->vertical_fov;
-  float prev_pitch = camera_->pitch;
-  camera_->pitch = 0.f;
-  camera_->vertical_fov = 90.f;
-
-  // Start with back view
-  std::vector<Matuc> faces;
-  camera_->turn(180.f, 0.f);
-  faces.push_back(render());
-
-  // Render left, front, and right views
-  for (int i = 1; i < 4; i++) {
-    camera_->turn(90.f, 0.f);
-    faces.push_back(render());
+  auto mode = getMode();
+  if (mode == SUNCGScene::RenderMode::DEPTH_FLOAT)
+    throw std::runtime_error("renderCubeMap() does not support DEPTH_FLOAT mode!");
+  if (!cube_fb_) {
+    GLint max_size = 0;
+    glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &max_size);
+    if (geo_.w * 6 > max_size)
+      throw std::runtime_error(ssprintf(
+            "Cube map of width %d exceeds the maximum framebuffer size %d!", geo_.w * 6, max_size));
+    cube_fb_.reset(new Framebuffer{Geometry{geo_.w * 6, geo_.h}});
   }
-  camera_->turn(-90.f, 0.f);
-
-  // Render the top and bottom views
-  camera_->turn(0.f, 89.f);
-  faces.push_back(render());
 
-  camera_->turn(0.f, 2 * -89.f);
-  faces.push_back(render());
+  // BACK, LEFT, FORWARD, RIGHT, UP, DOWN
+  Camera face{*camera_};
+  face.vertical_fov = 90.f;
+  face.pitch = 0.f;
+  std::vector<Camera> faces(6, face);
+  const float yaw[6] = {180.f, 270.f, 0.f, 90.f, 0.f, 0.f};
+  const float pitch[6] = {0.f, 0.f, 0.f, 0.f, 89.f, -89.f};
+  for (int i = 0; i < 6; ++i)
+    faces[i].turn(yaw[i], pitch[i]);
 
-  // Reset camera
-  camera_->vertical_fov = prev_fov;
-  camera_->pitch = prev_pitch;
-  camera_->updateDirection();
+  // Draw all faces side by side into one framebuffer,
+  // which is then read back in the final 6w * h layout.
+  FramebufferScope fb{*cube_fb_};
+  scene_->get_shader()->use();
+  glEnable(GL_SCISSOR_TEST);
+  for (int i = 0; i < 6; ++i)
+    draw_tile_(faces[i], i * geo_.w, 0);
+  glDisable(GL_SCISSOR_TEST);
+  glViewport(0, 0, geo_.w, geo_.h);
 
-  return hconcat(faces);
+  Matuc ret{geo_.h, geo_.w * 6, numChannels()};
+  if (mode == SUNCGScene::RenderMode::DEPTH) {
+    depth_buf_.resize(geo_.area() * 6 * 3);
+    fb.capture(depth_buf_.data());
+    convert_depth_(depth_buf_.data(), ret.ptr(), geo_.area() * 6);
+  } else {
+    fb.capture(ret.ptr());
+  }
+  return ret;
 }
 
 void SUNCGRenderAPI::loadScene(
     std::string obj_file, std::string model_category_file,
     std::string semantic_label_file) {
   // check cache for previously loaded scenes
-  scene_ = dynamic_cast<SUNCGScene*>(scene_cache_.get(obj_file));
-  if (!scene_) {
-    scene_ = new SUNCGScene{obj_file, model_category_file, semantic_label_file};
+  SUNCGScene* cached = dynamic_cast<SUNCGScene*>(scene_cache_.get(obj_file));
+  // the current scene stays if the new one fails to load
+  if (cached) {
+    scene_ = cached;
+  } else {
+    unique_ptr<SUNCGScene> scene;
+    auto itr = prefetching_.find(obj_file);
+    if (itr != prefetching_.end()) {
+      // forget the build before get(), which rethrows its errors
+      auto future = std::move(itr->second);
+      prefetching_.erase(itr);
+      scene = future.get();
+    } else {
+      scene.reset(build_scene(obj_file, model_category_file, semantic_label_file,
+            vertex_format_, max_texture_size_, context_->share_group()));
+    }
+    scene->set_release_host_data(release_host_data_);
+    scene->activate();
+    scene_ = scene.release();
     scene_cache_.put(obj_file, scene_);
   }
   init_camera_();
 }
 
+void SUNCGRenderAPI::prefetchScene(
+    std::string obj_file, std::string model_category_file,
+    std::string semantic_label_file) {
+  if (scene_cache_.contains(obj_file) || prefetching_.count(obj_file))
+    return;
+  VertexFormat vertex_format = vertex_format_;
+  int max_texture_size = max_texture_size_;
+  auto group = context_->share_group();
+  prefetching_.emplace(obj_file, std::async(std::launch::async, [=]() {
+        return unique_ptr<SUNCGScene>{build_scene(
+            obj_file, model_category_file, semantic_label_file,
+            vertex_format, max_texture_size, group)};
+      }));
+}
+
 }
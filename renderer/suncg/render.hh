@@ -11,16 +11,21 @@
 #include <utility>
 #include <future>
 #include <queue>
+#include <deque>
+#include <unordered_map>
+#include <stdexcept>
 #include <glm/glm.hpp>
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/component_wise.hpp>
 
 #include "scene.hh"
 #include "gl/fbScope.hh"
+#include "gl/pixelBuffer.hh"
 #include "gl/glContext.hh"
 #include "gl/camera.hh"
 #include "model/scenecache.hh"
 #include "lib/executor.hh"
+#include "lib/strutils.hh"
 
 namespace render {
 
@@ -28,9 +33,16 @@ namespace render {
 // If not, use SUNCGRenderAPIThread.
 class SUNCGRenderAPI {
   public:
-    SUNCGRenderAPI(int w, int h, int device)
-      : context_(render::createHeadlessContext(Geometry{w, h}, device)),
-      geo_{w, h}, fb_{geo_} {
+    // If `share` is given, the GL context joins its share group (see createHeadlessContext()),
+    // and a scene loaded by both instances is uploaded to GPU once: only the framebuffers
+    // and vertex arrays are per instance. `share` needs to be on the same device.
+    // backend: the kind of GL context. GLBackend::SOFTWARE renders on CPU with
+    //   num_threads threads (0 for one per CPU), and ignores device.
+    SUNCGRenderAPI(int w, int h, int device, const SUNCGRenderAPI* share=nullptr,
+        GLBackend backend=GLBackend::AUTO, int num_threads=0)
+      : context_(render::createHeadlessContext(Geometry{w, h}, device,
+            share ? share->context_.get() : nullptr, backend, num_threads)),
+      geo_{w, h}, max_texture_size_{default_max_texture_size(geo_)}, fb_{geo_} {
         // enable the common context options
         glEnable(GL_DEPTH_TEST);
         glEnable(GL_BLEND);
@@ -39,14 +51,69 @@ class SUNCGRenderAPI {
       }
 
     // Load the scene objects to GPU, and unload current scene if it exists.
-    // obj_file: house.obj in SUNCG
+    // obj_file: house.obj in SUNCG, or a scene file written by preprocess-suncg.
+    //   An up-to-date house.h3d next to house.obj is used instead of the obj.
     // model_category_file: path to ModelCategoryMapping.csv
     // semantic_label_file: path to colormap_coarse.csv or colormap_fine.csv
     void loadScene(
         std::string obj_file, std::string model_category_file,
         std::string semantic_label_file);
 
+    // Start building the scene in a background thread and return immediately.
+    // A later loadScene() of the same obj_file only uploads it to GPU, or waits
+    // for the build to finish. Arguments are the same as loadScene().
+    // Does nothing if the scene is loaded or being prefetched already.
+    void prefetchScene(
+        std::string obj_file, std::string model_category_file,
+        std::string semantic_label_file);
+
+    // Loaded scenes are cached. The most recently used ones stay on GPU while their total
+    // size is within the GPU budget, so switching back to them is free. Scenes beyond the
+    // host budget are removed from the cache. The current scene is never evicted.
+    // By default only the current scene is on GPU, and the host memory is not limited.
+    void setGPUMemoryBudget(size_t bytes) { scene_cache_.set_gpu_budget(bytes); }
+    void setHostMemoryBudget(size_t bytes) { scene_cache_.set_host_budget(bytes); }
+
+    // Whether scenes loaded afterwards free their host copies of the vertices and
+    // textures once they are on GPU. See SUNCGScene::set_release_host_data().
+    // Saves host memory at the cost of reading them back when the scene is activated again.
+    void setReleaseHostData(bool release) { release_host_data_ = release; }
+
+    // Whether render() and renderBatch() draw the modes other than RGB on CPU,
+    // with num_threads threads (0 for one per CPU), instead of with GL.
+    // See TileRasterizer. Images are the same as GL draws them, up to rounding at the
+    // edges of triangles. Needs the host copy of the scene, so it does not work
+    // with setReleaseHostData(true). Off by default.
+    void setCPURasterizer(bool enable, int num_threads=0) {
+      if (num_threads < 0)
+        throw std::invalid_argument("Number of threads has to be non-negative!");
+      rasterizer_.reset(enable ? new TileRasterizer{num_threads} : nullptr);
+    }
+
     void setMode(SUNCGScene::RenderMode m) { scene_->set_mode(m); }
+    SUNCGScene::RenderMode getMode() const { return scene_->get_mode(); }
+
+    // Vertex layout on GPU of the scenes loaded afterwards. Defaults to FLOAT.
+    // Scenes that are already in the cache are not changed.
+    // Use COMPACT_NO_TEXCOORD only if RGB mode is not needed.
+    void setVertexFormat(VertexFormat f) { vertex_format_ = f; }
+
+    // Textures of the scenes loaded afterwards are downscaled to at most this size.
+    // Defaults to the smallest power of two that covers the resolution, which keeps
+    // all the details visible at that resolution. 0 means no limit.
+    void setMaxTextureSize(int size) {
+      if (size < 0)
+        throw std::invalid_argument("Max texture size has to be non-negative!");
+      max_texture_size_ = size;
+    }
+    int getMaxTextureSize() const { return max_texture_size_; }
+
+    static int default_max_texture_size(Geometry geo) {
+      int size = 1;
+      while (size < std::max(geo.w, geo.h))
+        size *= 2;
+      return size;
+    }
 
     // Render the image. The return format depends on the rendering mode, which
     // is set with the method above:
@@ -79,10 +146,65 @@ class SUNCGRenderAPI {
     //    NEAR = 0.3 # has to match minDepth parameter
     //    depth = NEAR * PIXEL_MAX / inverse_depth_16.astype(np.float)
     //
+    // DEPTH_FLOAT mode is not supported by this method. Use renderFloat().
     Matuc render();
 
+    // Render in DEPTH_FLOAT mode. Returns a 1-channel float image,
+    // where each pixel is the depth in meters (distance along the camera's
+    // front direction). Pixels at infinity depth have value +inf.
+    // Depth is computed on GPU and read from a 32-bit float buffer, so it
+    // has neither the 20 meters clipping nor the 8-bit quantization of DEPTH mode.
+    Mat32f renderFloat();
+
+    // Same as render() or renderFloat(), but write the image to `dst`, which has to hold
+    // h * w * numChannels() elements: float in DEPTH_FLOAT mode, unsigned char otherwise.
+    // No memory is allocated for the image.
+    void render(void* dst);
+
+    // Same as render(dst), but from the given camera. The API camera is not used.
+    void render(const Camera& camera, void* dst);
+
+    // Number of channels of the image rendered in the current mode.
+    int numChannels() const {
+      switch (scene_->get_mode()) {
+        case SUNCGScene::RenderMode::DEPTH: return 2;
+        case SUNCGScene::RenderMode::DEPTH_FLOAT: return 1;
+        default: return 3;
+      }
+    }
+
+    // Render the scene from each of the given cameras in the current mode,
+    // and write the images to `dst` one after another, i.e. as an array of
+    // N * h * w * numChannels() elements, of the type used by render(void*).
+    // The cameras are drawn into tiles of one large framebuffer, which is read
+    // back once, so the fixed cost of a readback is paid once per batch.
+    // The aspect ratio of all cameras is w / h. The API camera is not changed.
+    void renderBatch(const std::vector<Camera>& cameras, void* dst);
+
+    // Render several modes from one pass over the scene, and return one image
+    // per requested mode, in the same order as `modes`.
+    // Each image has the same format as returned by render() in that mode.
+    // The mode set by setMode() is not used or changed.
+    // DEPTH_FLOAT is not supported.
+    std::vector<Matuc> renderMulti(const std::vector<SUNCGScene::RenderMode>& modes);
+
+    // Pipelined rendering: renderAsync() draws the scene and starts reading the
+    // image back without waiting for it. fetch() waits for the oldest frame
+    // started by renderAsync() and returns it in the same format as render().
+    // Up to ASYNC_QUEUE_SIZE frames can be in flight, so the next frame can be
+    // drawn while previous frames are still being transferred.
+    // Camera and mode are captured when renderAsync() is called.
+    // DEPTH_FLOAT is not supported.
+    void renderAsync();
+    Matuc fetch();
+    // Number of frames started by renderAsync() but not fetched yet.
+    int numPendingFrames() const { return async_modes_.size(); }
+
+    static const int ASYNC_QUEUE_SIZE = 3;
+
     // Render a cube map of size 6w * h * c.  See render() for rendering details.
     // Cube map orientations are { BACK, LEFT, FORWARD, RIGHT, UP, DOWN }
+    // All faces are drawn into one framebuffer and read back at once.
     Matuc renderCubeMap();
 
     // Print OpenGL context info.
@@ -107,13 +229,54 @@ class SUNCGRenderAPI {
     }
 
     private:
+    std::unique_ptr<GLContext> context_;
+    // Declared after context_, so that the scenes are freed in the context.
+    // Shared objects would stay in the group otherwise.
     SceneCache scene_cache_;
     SUNCGScene* scene_ = nullptr; // no ownership
 
-    std::unique_ptr<GLContext> context_;
     std::unique_ptr<Camera> camera_;
     Geometry geo_;
+    int max_texture_size_;
+    VertexFormat vertex_format_ = VertexFormat::FLOAT;
+    bool release_host_data_ = false;
     Framebuffer fb_;
+    // with one color attachment per RenderMode, created on first use
+    std::unique_ptr<Framebuffer> multi_fb_;
+    // float framebuffer used by DEPTH_FLOAT mode, created on first use
+    std::unique_ptr<Framebuffer> depth_fb_;
+    // framebuffer of vertically stacked tiles used by renderBatch()
+    std::unique_ptr<Framebuffer> batch_fb_;
+
+    // framebuffer of 6 horizontally stacked tiles used by renderCubeMap()
+    std::unique_ptr<Framebuffer> cube_fb_;
+
+    // render `num` cameras into the top `num` tiles of batch_fb_, and read them back to dst
+    void render_tiles_(const Camera* cameras, int num, void* dst);
+    // draw the scene from `camera` into the geo_-sized tile at (x, y) of the bound framebuffer.
+    // Requires the shader in use and GL_SCISSOR_TEST enabled.
+    void draw_tile_(const Camera& camera, int x, int y);
+    // pixel buffers used by renderAsync(), created on first use
+    std::unique_ptr<PixelBufferRing> pbo_ring_;
+    // render modes of the frames in pbo_ring_, oldest first
+    std::deque<SUNCGScene::RenderMode> async_modes_;
+
+    // buffer of the color-encoded depth, reused in DEPTH mode
+    std::vector<unsigned char> depth_buf_;
+    // used instead of GL by setCPURasterizer()
+    std::unique_ptr<TileRasterizer> rasterizer_;
+    bool use_rasterizer_() const {
+      return rasterizer_ && getMode() != SUNCGScene::RenderMode::RGB;
+    }
+
+    // convert the captured color buffer to the output format of a mode
+    Matuc postprocess_(Matuc buf, SUNCGScene::RenderMode mode);
+    // convert `npixels` pixels of 3-channel color-encoded depth to the 2-channel DEPTH format
+    void convert_depth_(const unsigned char* src, unsigned char* dst, int npixels);
+
+    // scenes being built by prefetchScene(), by obj_file.
+    // Declared last so that the builds finish before anything else is destroyed.
+    std::unordered_map<std::string, std::future<std::unique_ptr<SUNCGScene>>> prefetching_;
 
     // set camera "smartly" to some place in the scene
     void init_camera_() {
@@ -129,12 +292,18 @@ class SUNCGRenderAPI {
 // As a result, you can do the following which is not allowed in SUNCGRenderAPI:
 // 1. Use the same instance in different threads.
 // 2. Create multiple instances in one thread.
-// Note that this class is still NOT thread-safe. You cannot call its methods concurrently.
+// Note that this class is still NOT thread-safe. You cannot call its methods concurrently:
+// jobs are passed to the dedicated thread by one producer at a time (see ExecutorInThread),
+// so callers in different threads have to serialize their calls, and that includes the
+// methods which wait without holding the Python GIL.
 class SUNCGRenderAPIThread {
   public:
-    SUNCGRenderAPIThread(int w, int h, int device) {
+    // See SUNCGRenderAPI for the arguments.
+    SUNCGRenderAPIThread(int w, int h, int device, const SUNCGRenderAPIThread* share=nullptr,
+        GLBackend backend=GLBackend::AUTO, int num_threads=0) {
+      const SUNCGRenderAPI* share_api = share ? share->api_.get() : nullptr;
       exec_.execute_sync([=]() {
-            this->api_.reset(new SUNCGRenderAPI{w, h, device});
+            this->api_.reset(new SUNCGRenderAPI{w, h, device, share_api, backend, num_threads});
           });
     }
 
@@ -152,7 +321,14 @@ class SUNCGRenderAPIThread {
 
     // caller doesn't own pointer
     Camera* getCamera() const { return api_->getCamera(); }
-    void setMode(SUNCGScene::RenderMode m) { api_->setMode(m); }
+    // in order with the frames queued by renderAsync()
+    void setMode(SUNCGScene::RenderMode m) {
+      exec_.execute_sync([=]() { this->api_->setMode(m); });
+    }
+    void setVertexFormat(VertexFormat f) { api_->setVertexFormat(f); }
+    void setMaxTextureSize(int size) { api_->setMaxTextureSize(size); }
+    int getMaxTextureSize() const { return api_->getMaxTextureSize(); }
+    SUNCGScene::RenderMode getMode() const { return api_->getMode(); }
     Geometry resolution() const { return api_->resolution(); }
 
     void loadScene(
@@ -163,10 +339,87 @@ class SUNCGRenderAPIThread {
           });
     }
 
+    void setGPUMemoryBudget(size_t bytes) {
+      exec_.execute_sync([=]() { this->api_->setGPUMemoryBudget(bytes); });
+    }
+
+    void setHostMemoryBudget(size_t bytes) {
+      exec_.execute_sync([=]() { this->api_->setHostMemoryBudget(bytes); });
+    }
+
+    void setReleaseHostData(bool release) { api_->setReleaseHostData(release); }
+
+    void setCPURasterizer(bool enable, int num_threads=0) {
+      exec_.execute_sync([=]() { this->api_->setCPURasterizer(enable, num_threads); });
+    }
+
+    void prefetchScene(
+        std::string obj_file, std::string model_category_file,
+        std::string semantic_label_file) {
+      exec_.execute_sync([=]() {
+            this->api_->prefetchScene(obj_file, model_category_file, semantic_label_file);
+          });
+    }
+
     Matuc render() {
       return exec_.execute_sync<Matuc>([=]() { return this->api_->render(); });
     }
 
+    Mat32f renderFloat() {
+      return exec_.execute_sync<Mat32f>([=]() { return this->api_->renderFloat(); });
+    }
+
+    void render(void* dst) {
+      exec_.execute_sync([=]() { this->api_->render(dst); });
+    }
+
+    int numChannels() const { return api_->numChannels(); }
+
+    void renderBatch(const std::vector<Camera>& cameras, void* dst) {
+      exec_.execute_sync([&]() { this->api_->renderBatch(cameras, dst); });
+    }
+
+    std::vector<Matuc> renderMulti(const std::vector<SUNCGScene::RenderMode>& modes) {
+      return exec_.execute_sync<std::vector<Matuc>>([&]() {
+        return this->api_->renderMulti(modes);
+      });
+    }
+
+    // Queue a frame of the current camera and mode, and return without waiting for it.
+    // The caller can queue more frames or do other work while the frame is rendered.
+    // The returned future gets the image, in the same format as render().
+    // The frame is also returned by fetch(), which returns the frames in order.
+    // Up to MAX_PENDING_FRAMES frames can be waiting for fetch().
+    // DEPTH_FLOAT is not supported.
+    std::shared_future<Matuc> renderAsync() {
+      if ((int)pending_.size() == MAX_PENDING_FRAMES)
+        throw std::runtime_error(ssprintf(
+              "Cannot have more than %d frames in flight. Call fetch() first!", MAX_PENDING_FRAMES));
+      if (getMode() == SUNCGScene::RenderMode::DEPTH_FLOAT)
+        throw std::runtime_error("renderAsync() does not support DEPTH_FLOAT mode!");
+      std::promise<Matuc> promise;
+      std::shared_future<Matuc> frame = promise.get_future().share();
+      exec_.execute_async(RenderJob{api_.get(), *api_->getCamera(), std::move(promise)});
+      pending_.push_back(frame);
+      return frame;
+    }
+
+    // Wait for the oldest frame queued by renderAsync() and not fetched yet, and return it.
+    Matuc fetch() { return fetchFuture().get(); }
+
+    // Same as fetch(), but return the future of the frame without waiting for it
+    std::shared_future<Matuc> fetchFuture() {
+      if (pending_.empty())
+        throw std::runtime_error("No frames to fetch. Call renderAsync() first!");
+      auto frame = std::move(pending_.front());
+      pending_.pop_front();
+      return frame;
+    }
+
+    int numPendingFrames() const { return pending_.size(); }
+
+    static const int MAX_PENDING_FRAMES = 16;
+
     Matuc renderCubeMap() {
       return exec_.execute_sync<Matuc>([=]() {
         return this->api_->renderCubeMap();
@@ -178,7 +431,27 @@ class SUNCGRenderAPIThread {
     }
 
     private:
+    // a frame queued by renderAsync()
+    struct RenderJob {
+      SUNCGRenderAPI* api;
+      Camera camera;
+      std::promise<Matuc> promise;
+
+      void operator()() {
+        try {
+          Geometry geo = api->resolution();
+          Matuc ret{geo.h, geo.w, api->numChannels()};
+          api->render(camera, ret.ptr());
+          promise.set_value(std::move(ret));
+        } catch (...) {
+          promise.set_exception(std::current_exception());
+        }
+      }
+    };
+
     std::unique_ptr<SUNCGRenderAPI> api_;
+    // frames queued by renderAsync() and not fetched yet, oldest first
+    std::deque<std::shared_future<Matuc>> pending_;
     ExecutorInThread exec_;
 };
 
@@ -10,7 +10,15 @@
 
 #include "category.hh"
 
+#include <algorithm>
+#include <cmath>
 #include <stdexcept>
+#include <limits>
+#include <map>
+#include <tuple>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
 
 using namespace std;
 
@@ -37,6 +45,10 @@ std::vector<glm::vec3> get_uniform_sampled_colors(int count) {
 }
 
 
+inline std::tuple<float, float, float> color_key(const glm::vec3& c) {
+  return std::make_tuple(c.x, c.y, c.z);
+}
+
 }
 
 namespace render {
@@ -47,7 +59,13 @@ const char* SUNCGShader::fShader = R"xxx(
 in vec3 pos;
 in vec3 normal;
 in vec2 texcoord;
-out vec4 fragcolor;
+layout(location = 0) out vec4 fragcolor;
+// Extra outputs written only in multi-output rendering.
+// Locations match the values of SUNCGScene::RenderMode, and location 0 is RGB.
+layout(location = 1) out vec4 semanticcolor;
+layout(location = 2) out vec4 depthcolor;
+layout(location = 3) out vec4 instancecolor;
+layout(location = 4) out vec4 invdepthcolor;
 
 // Note these values need to match DEFAULT_NEAR and DEFAULT_FAR in camera.h
 const float NEAR = 0.1f;
@@ -61,12 +79,20 @@ uniform uint mode;
 // 1: light
 // 2: const Kd
 // 3: depth
+// 4: inverse depth
+// 5: linear depth in meters, to a float buffer
 uniform vec3 Kd;
 uniform vec3 Ka;
 uniform vec3 eye;
 uniform float dissolve;
-uniform sampler2D texture_diffuse;
+// diffuse textures are layers of texture arrays
+uniform sampler2DArray texture_diffuse;
+uniform float textureLayer;
 uniform float minDepth = NEAR;
+// multi-output rendering: write all modalities in one pass
+uniform bool multiOutput = false;
+uniform vec3 labelColor;
+uniform vec3 instanceColor;
 
 // Convert depth buffer value to inverse depth.
 // The depth buffer value <d> is 0.0 for INV_NEAR, 1.0 for INV_FAR.
@@ -79,32 +105,27 @@ float TrueDepth(float d) {
     return 1.0f / InverseDepth(d);
 }
 
-void main() {
-    if (mode == 2u) { // constant
-      fragcolor = vec4(Kd, 1.0f);
-      return;
-    }
-    else if (mode == 3u) { // depth
-      float scaledDepth = TrueDepth(gl_FragCoord.z) / DEPTH_SCALE;
-      fragcolor = vec4(vec3(scaledDepth), 1.0f);
-      return;
-    }
-    else if (mode == 4u) { // inverse depth
-      float invDepth = InverseDepth(gl_FragCoord.z);
-      // invDepth \in [INV_FAR, INV_NEAR] i.e., [0.01, 10.0] with above values.
-      // We convert to 16 bits, with 65535 corresponding to INV_NEAR
-      float f = 65535 * minDepth * invDepth + 0.5; // \in [0.0, 65535.0]
-      float ms = floor(f/256.0f); // \in {0.0, .., 255.0}
-      float ls = floor(f - ms * 256.0f); // \in {0.0, .., 255.0}
-      fragcolor = vec4(ms/255.0f, ls/255.0f, 0.0f, 1.0f);
-      return;
-    }
+vec4 depthColor() {
+    float scaledDepth = TrueDepth(gl_FragCoord.z) / DEPTH_SCALE;
+    return vec4(vec3(scaledDepth), 1.0f);
+}
+
+vec4 invDepthColor() {
+    float invDepth = InverseDepth(gl_FragCoord.z);
+    // invDepth \in [INV_FAR, INV_NEAR] i.e., [0.01, 10.0] with above values.
+    // We convert to 16 bits, with 65535 corresponding to INV_NEAR
+    float f = 65535 * minDepth * invDepth + 0.5; // \in [0.0, 65535.0]
+    float ms = floor(f/256.0f); // \in {0.0, .., 255.0}
+    float ls = floor(f - ms * 256.0f); // \in {0.0, .., 255.0}
+    return vec4(ms/255.0f, ls/255.0f, 0.0f, 1.0f);
+}
 
+vec4 shadedColor() {
     float alpha = dissolve;
     vec3 color;
     switch(mode) {
       case 0u:
-        vec4 texcolor = texture(texture_diffuse, texcoord);
+        vec4 texcolor = texture(texture_diffuse, vec3(texcoord, textureLayer));
         // for suncg, every face has Kd. Just multiply them.
         color = Kd * texcolor.xyz;
         alpha = min(texcolor.w, alpha);
@@ -119,12 +140,57 @@ void main() {
     vec3 ambient = Ka * 0.1f;
     color = color * scale + ambient;
     color = clamp(color, 0.0f, 1.0f);
-    fragcolor = vec4(color, alpha);
+    return vec4(color, alpha);
+}
+
+void main() {
+    if (multiOutput) {
+      fragcolor = shadedColor();
+      semanticcolor = vec4(labelColor, 1.0f);
+      depthcolor = depthColor();
+      instancecolor = vec4(instanceColor, 1.0f);
+      invdepthcolor = invDepthColor();
+      return;
+    }
+    if (mode == 2u) { // constant
+      fragcolor = vec4(Kd, 1.0f);
+    }
+    else if (mode == 3u) { // depth
+      fragcolor = depthColor();
+    }
+    else if (mode == 4u) { // inverse depth
+      fragcolor = invDepthColor();
+    }
+    else if (mode == 5u) { // linear depth
+      fragcolor = vec4(TrueDepth(gl_FragCoord.z), 0.0f, 0.0f, 1.0f);
+    } else {
+      fragcolor = shadedColor();
+    }
 }
 )xxx";
 
-SUNCGShader::SUNCGShader():
-  Shader{BasicShader::vShader, fShader} {
+const char* SUNCGShader::vShaderPositionOnly = R"xxx(
+#version 330 core
+layout (location = 0) in vec3 posIn;
+
+out vec3 pos;
+out vec3 normal;
+out vec2 texcoord;
+
+uniform mat4 projection;
+
+void main()
+{
+    // not used by the fragment shader in these modes
+    texcoord = vec2(0.0f);
+    normal = vec3(0.0f);
+    pos = posIn;
+    gl_Position = projection * vec4(posIn, 1.0f);
+}
+)xxx";
+
+SUNCGShader::SUNCGShader(const char* vertexShader):
+  Shader{vertexShader, fShader} {
 
   Kd_loc = getUniformLocation("Kd");
   Ka_loc = getUniformLocation("Ka");
@@ -132,22 +198,24 @@ SUNCGShader::SUNCGShader():
   texture_loc = getUniformLocation("texture_diffuse");
   dissolve_loc = getUniformLocation("dissolve");
   minDepth_loc = getUniformLocation("minDepth");
+  multiOutput_loc = getUniformLocation("multiOutput");
+  labelColor_loc = getUniformLocation("labelColor");
+  instanceColor_loc = getUniformLocation("instanceColor");
+  textureLayer_loc = getUniformLocation("textureLayer");
   };
 
 
 SUNCGScene::SUNCGScene(string obj_file, string model_category_file,
-    string semantic_label_file, float minDepth):
+    string semantic_label_file, float minDepth, VertexFormat vertex_format,
+    int max_texture_size):
   ObjSceneBase{obj_file},
-  textures_{obj_.materials, obj_.base_dir},
+  textures_{obj_.materials, obj_.base_dir, true, max_texture_size},
   model_category_{model_category_file},
   semantic_color_{semantic_label_file},
-  minDepth_{minDepth}
+  minDepth_{minDepth},
+  obj_file_{obj_file}
 {
-    background_color_ = semantic_color_.get_background_color();
-
-    // use FINE_GRAINED if color mapping > 128
-    if (semantic_color_.size() > 128)
-      set_object_name_resolution_mode(ObjectNameResolution::FINE);
+    init_semantic_colors_();
 
     // filter out person
     model_category_.filter_category(obj_.shapes, {"person"});
@@ -157,24 +225,92 @@ SUNCGScene::SUNCGScene(string obj_file, string model_category_file,
     obj_.sort_by_transparent(textures_);
 
     parse_scene();
-    activate();
+    mesh_.set_vertex_format(vertex_format);
+}
+
+void SUNCGScene::init_semantic_colors_() {
+  background_color_ = semantic_color_.get_background_color();
+
+  // use FINE_GRAINED if color mapping > 128
+  if (semantic_color_.size() > 128)
+    set_object_name_resolution_mode(ObjectNameResolution::FINE);
 }
 
 void SUNCGScene::activate() {
+  // shaders are created in the context that draws the scene
+  if (!shader_) {
+    shader_.reset(new SUNCGShader);
+    geometry_shader_.reset(new SUNCGShader{SUNCGShader::vShaderPositionOnly});
+  }
+  // both read back the released host data, if they have to upload it
   textures_.activate();
-  int nr_mesh = mesh_.size();
-  m_assert(nr_mesh == (int)materials_.size());
+  m_assert(mesh_.size() == (int)materials_.size());
+  mesh_.set_host_data_loader([this]() { this->restore_host_data_(); });
+  mesh_.activate();
+  if (release_host_data_)
+    free_host_data_();
+}
 
-  for (int i = 0; i < nr_mesh; ++i) {
-    MaterialDesc& material = materials_[i];
-    material.texture = textures_.get(material.m->diffuse_texname);
-    mesh_[i].activate();
+void SUNCGScene::free_host_data_() {
+  if (scene_file_name_.empty()) {
+    // Keep the vertices in a scene file on disk. A file in memory (e.g. in a tmpfs /tmp)
+    // would not save any host memory.
+    const char* dir = getenv("HOUSE3D_SCENE_CACHE");
+    string name;
+    if (dir && dir[0]) {
+      name = ssprintf("%s/house3d-XXXXXX", dir);
+      int fd = mkstemp(&name[0]);
+      if (fd < 0)
+        error_throw(ssprintf("Cannot create a scene file in %s!", dir));
+      close(fd);
+      save(name);
+      remove_scene_file_ = true;
+    } else {
+      name = scene_file_name(obj_file_);
+      // other processes may be reading the file, so it's replaced at once
+      string tmp = ssprintf("%s.%d", name.c_str(), getpid());
+      try {
+        save(tmp);
+      } catch (const std::runtime_error& e) {
+        unlink(tmp.c_str());
+        error_throw(ssprintf("%s Set HOUSE3D_SCENE_CACHE to a writable directory "
+              "to release the host data of this scene.", e.what()));
+      }
+      if (rename(tmp.c_str(), name.c_str()) != 0) {
+        unlink(tmp.c_str());
+        error_throw(ssprintf("Cannot write %s!", name.c_str()));
+      }
+    }
+    scene_file_name_ = name;
   }
+  mesh_.release_host_data();
+  scene_file_.reset();
+  textures_.release_host_data();
+  obj_.attrib = tinyobj::attrib_t();
+}
+
+void SUNCGScene::restore_host_data_() {
+  scene_file_.reset(new MappedFile{scene_file_name_});
+  map_scene_file_();
+}
+
+SUNCGScene::~SUNCGScene() {
+  if (remove_scene_file_)
+    unlink(scene_file_name_.c_str());
+}
+
+size_t SUNCGScene::host_bytes() const {
+  auto& attrib = obj_.attrib;
+  size_t ret = mesh_.host_bytes() + textures_.host_bytes() +
+    (attrib.vertices.capacity() + attrib.normals.capacity() +
+     attrib.texcoords.capacity()) * sizeof(tinyobj::real_t);
+  if (scene_file_)
+    ret += scene_file_->size();
+  return ret;
 }
 
 void SUNCGScene::deactivate() {
-  for (auto& m : mesh_)
-    m.deactivate();
+  mesh_.deactivate();
   textures_.deactivate();
 }
 
@@ -226,74 +362,228 @@ void SUNCGScene::parse_scene() {
     m_assert(nr_face > 0);
 
     int mid = matids[0];
-    mesh_.emplace_back();
+    bool transparent = obj_.is_transparent_material(mid, textures_);
+    auto texture = textures_.get_layer(obj_.materials[mid].diffuse_texname);
     // Assume that obj_.materials won't change size any more
-    materials_.emplace_back(MaterialDesc{mid, label_color, instance_color, 0UL, &obj_.materials[mid]});
+    materials_.emplace_back(MaterialDesc{
+        mid, label_color, instance_color, texture, transparent, &obj_.materials[mid]});
 
     for (int f = 0; f < nr_face; ++f) {
       auto face = obj_.convertFace(tmesh, f);
       for (auto& v : face) {
-        mesh_.back().vertices.emplace_back(move(v));
+        mesh_.add_vertex(v);
         boxmin_ = glm::min(boxmin_, v.pos);
         boxmax_ = glm::max(boxmax_, v.pos);
       }
     }
+    mesh_.finish_mesh();
   }
-  mesh_.shrink_to_fit();
+  mesh_.vertices.shrink_to_fit();
+  mesh_.indices.shrink_to_fit();
+  print_debug("%lu unique vertices out of %lu.\n", mesh_.vertices.size(), mesh_.indices.size());
   obj_.shapes.clear();
   obj_.shapes.shrink_to_fit();
+  build_draw_groups_();
+}
+
+void SUNCGScene::build_draw_groups_() {
+  // Materials are grouped by their uniforms, rather than by id,
+  // so that different materials with identical look are drawn together.
+  auto shading_key = [this](int i) {
+    const auto& m = materials_[i];
+    return std::make_tuple(m.texture.array, m.texture.layer,
+        std::make_tuple(m.m->diffuse[0], m.m->diffuse[1], m.m->diffuse[2]),
+        std::make_tuple(m.m->ambient[0], m.m->ambient[1], m.m->ambient[2]),
+        m.m->dissolve);
+  };
+  shaded_groups_ = group_meshes_(shading_key);
+  multi_output_groups_ = group_meshes_([this, &shading_key](int i) {
+      const auto& m = materials_[i];
+      return std::make_tuple(shading_key(i),
+          color_key(m.label_color), color_key(m.instance_color));
+  });
+  sort_by_texture_(shaded_groups_);
+  sort_by_texture_(multi_output_groups_);
+  semantic_groups_ = group_meshes_(
+      [this](int i) { return color_key(materials_[i].label_color); });
+  instance_groups_ = group_meshes_(
+      [this](int i) { return color_key(materials_[i].instance_color); });
+  print_debug("Draw groups: %lu for RGB, %lu for semantic, %lu for instance, from %d meshes.\n",
+      shaded_groups_.size(), semantic_groups_.size(), instance_groups_.size(), mesh_.size());
+}
+
+void SUNCGScene::sort_by_texture_(std::vector<DrawGroup>& groups) const {
+  auto first_transparent = std::find_if(groups.begin(), groups.end(),
+      [this](const DrawGroup& g) { return materials_[g.mesh].transparent; });
+  std::stable_sort(groups.begin(), first_transparent,
+      [this](const DrawGroup& a, const DrawGroup& b) {
+        return materials_[a.mesh].texture.array < materials_[b.mesh].texture.array;
+      });
+}
+
+template <typename KeyFunc>
+std::vector<SUNCGScene::DrawGroup> SUNCGScene::group_meshes_(KeyFunc key) const {
+  using Key = decltype(key(0));
+  std::vector<DrawGroup> groups;
+  std::map<Key, int> opaque_groups;   // key -> index in groups
+  int nr_mesh = mesh_.size();
+  for (int i = 0; i < nr_mesh; ++i) {
+    Key k = key(i);
+    if (!materials_[i].transparent) {
+      auto itr = opaque_groups.find(k);
+      if (itr == opaque_groups.end()) {
+        opaque_groups.emplace(k, groups.size());
+        groups.emplace_back(DrawGroup{i, {}});
+        groups.back().batch.add(mesh_, i);
+      } else {
+        groups[itr->second].batch.add(mesh_, i);
+      }
+    } else {
+      // transparent meshes come after all opaque meshes
+      if (i > 0 && materials_[i - 1].transparent && key(i - 1) == k) {
+        groups.back().batch.add(mesh_, i);
+      } else {
+        groups.emplace_back(DrawGroup{i, {}});
+        groups.back().batch.add(mesh_, i);
+      }
+    }
+  }
+  return groups;
 }
 
 void SUNCGScene::draw() {
   glClearColor(background_color_.x, background_color_.y, background_color_.z, 1.0f);
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  if (mode_ == RenderMode::DEPTH_FLOAT) {
+    // pixels not covered by any object are infinitely far away
+    const GLfloat inf[4] = {numeric_limits<float>::infinity(), 0.f, 0.f, 0.f};
+    glClearBufferfv(GL_COLOR, 0, inf);
+  }
 
-  int nr_mesh = mesh_.size();
+  // Modes other than RGB use geometry_shader_ and only read positions.
   if (mode_ == RenderMode::RGB) {
-    for (int i = 0; i < nr_mesh; ++i) {
-      const auto& material = materials_[i];
-      static_assert(
-          std::is_same<std::decay<
-          decltype(material.m->diffuse[0])>::type, GLfloat>::value,
-          "tinyobj material type incompatible with GLfloat!");
-      glUniform3fv(shader_.Kd_loc, 1, (GLfloat*)&material.m->diffuse);
-      glUniform3fv(shader_.Ka_loc, 1, (GLfloat*)&material.m->ambient);
-      glUniform1f(shader_.dissolve_loc, material.m->dissolve);
-
-      auto mode = SUNCGShader::RenderMode::LIGHTING;
-      if (material.texture) {
-        glActiveTexture(GL_TEXTURE0);
-        glUniform1i(shader_.texture_loc, 0);  // use TU0
-        mode = SUNCGShader::RenderMode::TEXTURE_LIGHTING;
-      }
-      glUniform1ui(shader_.mode_loc, static_cast<GLuint>(mode));
-
-      TextureGuard TG{material.texture};
-      mesh_[i].draw();
-    }
+    draw_shaded_(false);
   } else if (mode_ == RenderMode::SEMANTIC || mode_ == RenderMode::INSTANCE) {
     auto mode = SUNCGShader::RenderMode::CONSTANT;
-    for (int i = 0; i < nr_mesh; ++i) {
+    glUniform1ui(geometry_shader_->mode_loc, static_cast<GLuint>(mode));
+    auto& groups = mode_ == RenderMode::SEMANTIC ? semantic_groups_ : instance_groups_;
+    for (auto& g : groups) {
       glm::vec3 color = mode_ == RenderMode::SEMANTIC ?
-        materials_[i].label_color : materials_[i].instance_color;
-      glUniform3fv(shader_.Kd_loc, 1, (GLfloat*)&color);
-      glUniform1ui(shader_.mode_loc, static_cast<GLuint>(mode));
-      mesh_[i].draw();
+        materials_[g.mesh].label_color : materials_[g.mesh].instance_color;
+      glUniform3fv(geometry_shader_->Kd_loc, 1, (GLfloat*)&color);
+      mesh_.draw(g.batch, true);
     }
   } else if (mode_ == RenderMode::DEPTH) {
     auto mode = SUNCGShader::RenderMode::DEPTH;
-    glUniform1ui(shader_.mode_loc, static_cast<GLuint>(mode));
-    for (int i = 0; i < nr_mesh; ++i)
-      mesh_[i].draw();
+    glUniform1ui(geometry_shader_->mode_loc, static_cast<GLuint>(mode));
+    mesh_.draw(true);
   } else if (mode_ == RenderMode::INVDEPTH) {
     auto mode = SUNCGShader::RenderMode::INVDEPTH;
-    glUniform1ui(shader_.mode_loc, static_cast<GLuint>(mode));
-    glUniform1f(shader_.minDepth_loc, minDepth_);
-    for (int i = 0; i < nr_mesh; ++i)
-      mesh_[i].draw();
+    glUniform1ui(geometry_shader_->mode_loc, static_cast<GLuint>(mode));
+    glUniform1f(geometry_shader_->minDepth_loc, minDepth_);
+    mesh_.draw(true);
+  } else if (mode_ == RenderMode::DEPTH_FLOAT) {
+    auto mode = SUNCGShader::RenderMode::LINEAR_DEPTH;
+    glUniform1ui(geometry_shader_->mode_loc, static_cast<GLuint>(mode));
+    // blending is not needed, and not every driver supports it on float buffers
+    glDisable(GL_BLEND);
+    mesh_.draw(true);
+    glEnable(GL_BLEND);
   } else {
     throw runtime_error("unknown render mode");
   }
 }
 
+void SUNCGScene::rasterize(TileRasterizer& rasterizer, const glm::mat4& projection,
+    Geometry geo, void* dst) {
+  if (mode_ == RenderMode::RGB)
+    throw runtime_error("RGB mode cannot be rendered on CPU!");
+  if (!mesh_.has_host_data())
+    throw runtime_error("Rendering on CPU needs the host data of the scene, which is released!");
+  if (cpu_bounds_.size() != materials_.size())
+    cpu_bounds_ = TileRasterizer::compute_bounds(mesh_);
+  rasterizer.draw(mesh_, cpu_bounds_, projection, geo);
+
+  // the same as InverseDepth(), depthColor() and invDepthColor() in fShader
+  const float NEAR = 0.1f, FAR = 100.f, DEPTH_SCALE = 20.f;
+  auto to_unorm = [](float c) {
+    return static_cast<unsigned char>(std::round(glm::clamp(c, 0.f, 1.f) * 255.f));
+  };
+  auto write_color = [&](unsigned char* p, const glm::vec3& c) {
+    p[0] = to_unorm(c.x); p[1] = to_unorm(c.y); p[2] = to_unorm(c.z);
+  };
+  float* dst_float = static_cast<float*>(dst);
+  unsigned char* dst_color = static_cast<unsigned char*>(dst);
+  for (int y = 0; y < geo.h; ++y) {
+    for (int x = 0; x < geo.w; ++x) {
+      int i = y * geo.w + x;
+      int mesh = rasterizer.mesh_id(x, y);
+      float inv_depth = 1.f / NEAR + rasterizer.depth(x, y) * (1.f / FAR - 1.f / NEAR);
+      if (mode_ == RenderMode::DEPTH_FLOAT) {
+        dst_float[i] = mesh < 0 ? numeric_limits<float>::infinity() : 1.f / inv_depth;
+        continue;
+      }
+      unsigned char* p = dst_color + i * 3;
+      if (mesh < 0) {
+        write_color(p, background_color_);
+      } else if (mode_ == RenderMode::SEMANTIC) {
+        write_color(p, materials_[mesh].label_color);
+      } else if (mode_ == RenderMode::INSTANCE) {
+        write_color(p, materials_[mesh].instance_color);
+      } else if (mode_ == RenderMode::DEPTH) {
+        write_color(p, glm::vec3(1.f / inv_depth / DEPTH_SCALE));
+      } else {
+        float f = 65535 * minDepth_ * inv_depth + 0.5f;
+        float ms = std::floor(f / 256.f), ls = std::floor(f - ms * 256.f);
+        write_color(p, glm::vec3(ms / 255.f, ls / 255.f, 0.f));
+      }
+    }
+  }
+}
+
+void SUNCGScene::draw_all_modes() {
+  glClearColor(background_color_.x, background_color_.y, background_color_.z, 1.0f);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+  glUniform1i(shader_->multiOutput_loc, 1);
+  glUniform1f(shader_->minDepth_loc, minDepth_);
+  draw_shaded_(true);
+  glUniform1i(shader_->multiOutput_loc, 0);
+}
+
+void SUNCGScene::draw_shaded_(bool multi_output) {
+  glActiveTexture(GL_TEXTURE0);
+  glUniform1i(shader_->texture_loc, 0);  // use TU0
+  // groups are sorted by texture array, so each array is bound once
+  int bound_array = -1;
+  for (auto& g : multi_output ? multi_output_groups_ : shaded_groups_) {
+    const auto& material = materials_[g.mesh];
+    static_assert(
+        std::is_same<std::decay<
+        decltype(material.m->diffuse[0])>::type, GLfloat>::value,
+        "tinyobj material type incompatible with GLfloat!");
+    glUniform3fv(shader_->Kd_loc, 1, (GLfloat*)&material.m->diffuse);
+    glUniform3fv(shader_->Ka_loc, 1, (GLfloat*)&material.m->ambient);
+    glUniform1f(shader_->dissolve_loc, material.m->dissolve);
+    if (multi_output) {
+      glUniform3fv(shader_->labelColor_loc, 1, (GLfloat*)&material.label_color);
+      glUniform3fv(shader_->instanceColor_loc, 1, (GLfloat*)&material.instance_color);
+    }
+
+    auto mode = SUNCGShader::RenderMode::LIGHTING;
+    if (material.texture.array >= 0) {
+      if (material.texture.array != bound_array) {
+        bound_array = material.texture.array;
+        glBindTexture(GL_TEXTURE_2D_ARRAY, textures_.get_array(bound_array));
+      }
+      glUniform1f(shader_->textureLayer_loc, material.texture.layer);
+      mode = SUNCGShader::RenderMode::TEXTURE_LIGHTING;
+    }
+    glUniform1ui(shader_->mode_loc, static_cast<GLuint>(mode));
+
+    mesh_.draw(g.batch);
+  }
+  glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+
 }   // namespace render
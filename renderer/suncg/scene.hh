@@ -7,6 +7,7 @@
 
 #pragma once
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -17,8 +18,11 @@
 
 #include "model/obj.hh"
 #include "model/mesh.hh"
+#include "model/rasterizer.hh"
 #include "model/scene.hh"
 #include "gl/shader.hh"
+#include "model/shader.hh"
+#include "lib/mappedfile.hh"
 
 #include "suncg/category.hh"
 #include "suncg/color_mapping.hh"
@@ -27,43 +31,125 @@ namespace render {
 
 class SUNCGShader: public Shader {
   public:
-    SUNCGShader();
+    explicit SUNCGShader(const char* vertexShader = BasicShader::vShader);
 
     static const char* fShader;
+    // Vertex shader which reads only positions, for the modes that don't need
+    // normals and texcoords, i.e. CONSTANT and the depth modes.
+    static const char* vShaderPositionOnly;
     GLint Kd_loc, Ka_loc, mode_loc,
-          texture_loc, dissolve_loc, minDepth_loc;
+          texture_loc, dissolve_loc, minDepth_loc,
+          multiOutput_loc, labelColor_loc, instanceColor_loc,
+          textureLayer_loc;
 
     enum class RenderMode : GLuint {
       TEXTURE_LIGHTING = 0,
       LIGHTING = 1,
       CONSTANT = 2,
       DEPTH = 3,
-      INVDEPTH = 4
+      INVDEPTH = 4,
+      LINEAR_DEPTH = 5
     };
 };
 
 class SUNCGScene : public ObjSceneBase {
   public:
+    static constexpr float DEFAULT_MIN_DEPTH = 0.3f;
+
+    // The scene is not activated, and construction does not need a GL context,
+    // so it can happen in any thread. Call activate() in the GL context before drawing.
+    // vertex_format: layout of the vertices on GPU, see VertexFormat
+    // max_texture_size: textures are downscaled to at most this size, 0 for no limit
     explicit SUNCGScene(
         std::string obj_file,
         std::string model_category_file,
         std::string semantic_label_file,
-        float minDepth = 0.3);
-    ~SUNCGScene() {}
+        float minDepth = DEFAULT_MIN_DEPTH,
+        VertexFormat vertex_format = VertexFormat::FLOAT,
+        int max_texture_size = 0);
+    ~SUNCGScene();
+
+    // Load a scene written by save(), which is much faster than parsing the obj.
+    // Vertices are uploaded directly from the memory-mapped file.
+    // Other arguments are the same as the constructor. Caller owns the pointer.
+    static SUNCGScene* load(
+        std::string scene_file,
+        std::string model_category_file,
+        std::string semantic_label_file,
+        float minDepth = DEFAULT_MIN_DEPTH,
+        VertexFormat vertex_format = VertexFormat::FLOAT,
+        int max_texture_size = 0);
+
+    // Whether the file is a scene file of the current version.
+    static bool is_scene_file(const std::string& fname);
+
+    // The default scene file of an obj, i.e. house.obj -> house.h3d
+    static std::string scene_file_name(const std::string& obj_file) {
+      auto pos = obj_file.rfind(".obj");
+      if (pos != std::string::npos && pos + 4 == obj_file.size())
+        return obj_file.substr(0, pos) + ".h3d";
+      return obj_file + ".h3d";
+    }
+
+    // Save the parsed scene to a binary file. See sceneFile.cc for the format.
+    void save(const std::string& fname) const;
 
     void draw() override;
+    // Draw every RenderMode in one pass. Fragment output at location i
+    // holds the image of RenderMode i, so the caller needs to bind
+    // a framebuffer with the corresponding color attachments.
+    void draw_all_modes();
     void activate() override;
     void deactivate() override;
 
-    Shader* get_shader() override { return &shader_; }
+    // Render the current mode on CPU with `rasterizer`, from the vertices in host memory,
+    // and write the image to `dst` in the format captured from draw():
+    // 3 bytes per pixel, or a float per pixel in DEPTH_FLOAT mode. Rows start from the top.
+    // RGB mode is not supported, nor a scene whose host data has been released.
+    // Does not need a GL context.
+    void rasterize(TileRasterizer& rasterizer, const glm::mat4& projection,
+        Geometry geo, void* dst);
+
+    // Free the host copies of vertices, textures and the parsed obj after each
+    // activate(). A later activate() reads them back from the scene file and
+    // TextureStore, only if they are not in the share group already.
+    // A scene parsed from an obj is saved for that to its scene_file_name(), as
+    // preprocess-suncg does, or to a temporary file removed with the scene, in the
+    // directory $HOUSE3D_SCENE_CACHE if it is set. Off by default.
+    void set_release_host_data(bool release) { release_host_data_ = release; }
+
+    // Share the vertex buffers and textures with the scenes of the same key in other
+    // contexts of the group, so that they are uploaded once. Scenes of the same key
+    // have to be built from the same files with the same vertex format and texture size.
+    // Shaders and vertex arrays are per scene.
+    void set_share_group(std::shared_ptr<ShareGroup> group, const std::string& key) {
+      mesh_.set_share_group(group, key + ":mesh");
+      textures_.set_share_group(std::move(group), key + ":textures");
+    }
+
+    size_t gpu_bytes() const override {
+      return mesh_.gpu_bytes() + textures_.gpu_bytes();
+    }
+    size_t host_bytes() const override;
+
+    // The shader used by the current mode
+    Shader* get_shader() override {
+      return is_geometry_only_mode_() ? geometry_shader_.get() : shader_.get();
+    }
+    // The shader used by draw_all_modes()
+    Shader* get_multi_output_shader() { return shader_.get(); }
 
     enum class RenderMode {
       RGB = 0,
       SEMANTIC = 1,
       DEPTH = 2,
       INSTANCE = 3,
-      INVDEPTH = 4
+      INVDEPTH = 4,
+      DEPTH_FLOAT = 5
     };
+    // Number of modes rendered to an 8-bit color image,
+    // i.e. all modes except DEPTH_FLOAT.
+    static const int NUM_COLOR_RENDER_MODES = 5;
 
     enum class ObjectNameResolution {
       COARSE = 0,   // use its coarse class name
@@ -87,7 +173,32 @@ class SUNCGScene : public ObjSceneBase {
     }
 
   protected:
+    // modes that only need the vertex positions
+    bool is_geometry_only_mode_() const { return mode_ != RenderMode::RGB; }
+
+    // used by load()
+    SUNCGScene(
+        ObjLoader&& obj,
+        std::unique_ptr<MappedFile> scene_file,
+        std::string model_category_file,
+        std::string semantic_label_file,
+        float minDepth,
+        VertexFormat vertex_format,
+        int max_texture_size);
+
     void parse_scene();
+    // parse the meshes and materials of scene_file_
+    void parse_scene_file_();
+    // use the vertices and indices in scene_file_
+    void map_scene_file_();
+    void free_host_data_();
+    void restore_host_data_();
+    void init_semantic_colors_();
+    void build_draw_groups_();
+
+    // draw with lighting (and texture if available).
+    // If multi_output, also set uniforms needed by the other outputs.
+    void draw_shaded_(bool multi_output);
 
     std::string name_from_mode_id(std::string name) {
       // return the name used for rendering, from model id
@@ -102,30 +213,62 @@ class SUNCGScene : public ObjSceneBase {
 
     RenderMode mode_ = RenderMode::RGB;
     ObjectNameResolution object_name_mode_ = ObjectNameResolution::COARSE;
-    SUNCGShader shader_;
+    // created by the first activate()
+    std::unique_ptr<SUNCGShader> shader_, geometry_shader_;
     TextureRegistry textures_;
 
     ModelCategory model_category_;
     ColorMappingReader semantic_color_;
     glm::vec3 background_color_;
-    std::vector<Mesh> mesh_;
+    // all meshes of the scene, in one vertex buffer
+    MergedMesh mesh_;
     float minDepth_; // used for inverse depth mode
 
     struct MaterialDesc {
       int id;  // material id in tinyobj
       glm::vec3 label_color;
       glm::vec3 instance_color;
-      GLuint texture;
+      TextureRegistry::Layer texture;   // layer of the diffuse texture in textures_
+      bool transparent;
 
       // doesn't own this pointer
       const tinyobj::material_t* m;   // the material with the texture field changing
     };
     // material for each mesh. Must have same size as mesh_
     std::vector<MaterialDesc> materials_;
+    // bounds of each mesh, computed by the first rasterize()
+    std::vector<TileRasterizer::MeshBounds> cpu_bounds_;
+
+    // Meshes that are drawn with the same uniforms
+    struct DrawGroup {
+      int mesh;   // any mesh in the group, to look up its material
+      MergedMesh::DrawBatch batch;
+    };
+    // groups used by each mode
+    std::vector<DrawGroup> shaded_groups_, multi_output_groups_,
+      semantic_groups_, instance_groups_;
+
+    // Group meshes with equal key(mesh_id).
+    // Transparent meshes have to be drawn in order, so they are only
+    // grouped with the previous one.
+    template <typename KeyFunc>
+    std::vector<DrawGroup> group_meshes_(KeyFunc key) const;
+    // sort the opaque groups by texture array, to reduce texture binding
+    void sort_by_texture_(std::vector<DrawGroup>& groups) const;
 
     // keys: r * 256 * 256 + g * 256 + b
     // value: shape.name as in the obj file
     std::unordered_map<int, std::string> instance_color_to_name_;
+
+    // the file that holds the vertices, if the scene is loaded by load()
+    // or the host data is released
+    std::unique_ptr<MappedFile> scene_file_;
+    std::string scene_file_name_;
+    // empty if the scene is loaded by load()
+    std::string obj_file_;
+    // whether scene_file_name_ is a temporary file owned by the scene
+    bool remove_scene_file_ = false;
+    bool release_host_data_ = false;
 };
 
 } // namespace render
@@ -0,0 +1,299 @@
+// Copyright 2017-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the license found in the
+// LICENSE file in the root directory of this source tree.
+//File: sceneFile.cc
+
+// Binary scene files of SUNCGScene.
+// A file is laid out as:
+//    Header
+//    Vertex          vertices[num_vertices]
+//    uint32_t        indices[num_indices]
+//    MeshRecord      meshes[num_meshes]
+//    MaterialRecord  materials[num_materials]
+//    char            strings[strings_size]   (null-terminated names)
+// All in native byte order. The vertices are used in place by the renderer.
+
+#include "scene.hh"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+
+#include "lib/debugutils.hh"
+#include "lib/strutils.hh"
+
+using namespace std;
+
+namespace {
+
+const char MAGIC[8] = {'H', '3', 'D', 'S', 'C', 'E', 'N', 'E'};
+// bump this whenever the layout changes
+const uint32_t VERSION = 2;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t vertex_size;   // sizeof(Vertex) of the writer
+  uint64_t num_vertices, num_indices, num_meshes, num_materials, strings_size;
+  float boxmin[3], boxmax[3];
+};
+
+struct MeshRecord {
+  int32_t first, count;   // range in the indices
+  int32_t material;
+  float instance_color[3];
+  uint32_t name;  // offset of the shape name in strings
+};
+
+struct MaterialRecord {
+  float diffuse[3], ambient[3], dissolve;
+  uint32_t name, diffuse_texname;  // offsets in strings
+};
+
+static_assert(sizeof(Header) % 4 == 0, "vertices need to be aligned in the file!");
+static_assert(sizeof(GLuint) == sizeof(uint32_t), "indices are saved as uint32_t!");
+
+// Append a null-terminated string to the table and return its offset
+uint32_t add_string(string& table, const string& s) {
+  uint32_t ret = table.size();
+  table += s;
+  table += '\0';
+  return ret;
+}
+
+// the key of instance_color_to_name_, from a color in [0, 1]
+int instance_color_key(const glm::vec3& c) {
+  return lround(c.x * 255) * 256 * 256 + lround(c.y * 255) * 256 + lround(c.z * 255);
+}
+
+template <typename T>
+void write_array(ofstream& out, const vector<T>& v) {
+  out.write(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T));
+}
+
+bool check_header(const char* data, size_t size) {
+  if (size < sizeof(Header))
+    return false;
+  auto& header = *reinterpret_cast<const Header*>(data);
+  return memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0 &&
+    header.version == VERSION &&
+    header.vertex_size == sizeof(render::Vertex);
+}
+
+// Check the header and the sizes of all arrays against the size of the file,
+// and return the header.
+const Header& check_scene_file(const char* data, size_t size, const string& fname) {
+  if (!check_header(data, size))
+    error_throw(ssprintf("%s is not a scene file of version %u!", fname.c_str(), VERSION));
+  auto& header = *reinterpret_cast<const Header*>(data);
+  // take the arrays one by one from the rest of the file, so that the sizes cannot overflow
+  uint64_t remain = size - sizeof(Header);
+  auto take = [&](uint64_t num, size_t elem_size) {
+    if (num > remain / elem_size)
+      error_throw(ssprintf("Scene file %s is truncated!", fname.c_str()));
+    remain -= num * elem_size;
+  };
+  take(header.num_vertices, sizeof(render::Vertex));
+  take(header.num_indices, sizeof(uint32_t));
+  take(header.num_meshes, sizeof(MeshRecord));
+  take(header.num_materials, sizeof(MaterialRecord));
+  take(header.strings_size, 1);
+  if (remain != 0)
+    error_throw(ssprintf("Scene file %s has %lu extra bytes!", fname.c_str(), (unsigned long)remain));
+  // then every offset in the table points to a null-terminated string
+  if (header.strings_size != 0 && data[size - 1] != '\0')
+    error_throw(ssprintf("Strings in scene file %s are not terminated!", fname.c_str()));
+  return header;
+}
+
+const char* get_string(const char* strings, const Header& header,
+    uint32_t offset, const string& fname) {
+  if (offset >= header.strings_size)
+    error_throw(ssprintf("Bad string offset %u in scene file %s!", offset, fname.c_str()));
+  return strings + offset;
+}
+
+}
+
+namespace render {
+
+bool SUNCGScene::is_scene_file(const string& fname) {
+  ifstream in(fname, ios::binary);
+  char data[sizeof(Header)];
+  if (!in.read(data, sizeof(Header)))
+    return false;
+  return check_header(data, sizeof(Header));
+}
+
+void SUNCGScene::save(const string& fname) const {
+  // vertices are not in memory between free_host_data_() and activate()
+  m_assert(mesh_.has_host_data());
+  Header header;
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.vertex_size = sizeof(Vertex);
+  header.num_vertices = mesh_.num_vertices();
+  header.num_indices = mesh_.num_indices();
+  header.num_meshes = mesh_.size();
+  header.num_materials = obj_.materials.size();
+  for (int k = 0; k < 3; ++k) {
+    header.boxmin[k] = boxmin_[k];
+    header.boxmax[k] = boxmax_[k];
+  }
+
+  string strings;
+  vector<MeshRecord> meshes;
+  for (int i = 0; i < mesh_.size(); ++i) {
+    auto& material = materials_[i];
+    MeshRecord rec;
+    rec.first = mesh_.first[i];
+    rec.count = mesh_.count[i];
+    rec.material = material.id;
+    for (int k = 0; k < 3; ++k)
+      rec.instance_color[k] = material.instance_color[k];
+    int key = instance_color_key(material.instance_color);
+    rec.name = add_string(strings, instance_color_to_name_.at(key));
+    meshes.push_back(rec);
+  }
+
+  vector<MaterialRecord> materials;
+  for (auto& m : obj_.materials) {
+    MaterialRecord rec;
+    for (int k = 0; k < 3; ++k) {
+      rec.diffuse[k] = m.diffuse[k];
+      rec.ambient[k] = m.ambient[k];
+    }
+    rec.dissolve = m.dissolve;
+    rec.name = add_string(strings, m.name);
+    rec.diffuse_texname = add_string(strings, m.diffuse_texname);
+    materials.push_back(rec);
+  }
+  header.strings_size = strings.size();
+
+  ofstream out(fname, ios::binary);
+  if (!out)
+    error_throw(ssprintf("Cannot open %s for writing!", fname.c_str()));
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(mesh_.vertex_data()),
+      mesh_.num_vertices() * sizeof(Vertex));
+  out.write(reinterpret_cast<const char*>(mesh_.index_data()),
+      mesh_.num_indices() * sizeof(GLuint));
+  write_array(out, meshes);
+  write_array(out, materials);
+  out.write(strings.data(), strings.size());
+  if (!out)
+    error_throw(ssprintf("Failed to write %s!", fname.c_str()));
+}
+
+SUNCGScene* SUNCGScene::load(
+    string scene_file, string model_category_file,
+    string semantic_label_file, float minDepth, VertexFormat vertex_format,
+    int max_texture_size) {
+  unique_ptr<MappedFile> file{new MappedFile{scene_file}};
+  const char* data = file->data();
+  auto& header = check_scene_file(data, file->size(), scene_file);
+  size_t expected_size = file->size();
+
+  // Materials are needed by the TextureRegistry before the scene is constructed
+  ObjLoader obj;
+  auto pos = scene_file.find_last_of('/');
+  obj.base_dir = pos == string::npos ? "./" : scene_file.substr(0, pos + 1);
+  auto records = reinterpret_cast<const MaterialRecord*>(
+      data + expected_size - header.strings_size - header.num_materials * sizeof(MaterialRecord));
+  const char* strings = data + expected_size - header.strings_size;
+  for (uint64_t i = 0; i < header.num_materials; ++i) {
+    auto& rec = records[i];
+    tinyobj::material_t m;
+    for (int k = 0; k < 3; ++k) {
+      m.diffuse[k] = rec.diffuse[k];
+      m.ambient[k] = rec.ambient[k];
+    }
+    m.dissolve = rec.dissolve;
+    m.name = get_string(strings, header, rec.name, scene_file);
+    m.diffuse_texname = get_string(strings, header, rec.diffuse_texname, scene_file);
+    obj.materials.emplace_back(move(m));
+  }
+  auto ret = new SUNCGScene{move(obj), move(file),
+    model_category_file, semantic_label_file, minDepth, vertex_format, max_texture_size};
+  ret->scene_file_name_ = scene_file;
+  return ret;
+}
+
+void SUNCGScene::map_scene_file_() {
+  const char* data = scene_file_->data();
+  // the file may have been replaced since the scene is loaded
+  auto& header = check_scene_file(data, scene_file_->size(), scene_file_name_);
+  if (mesh_.num_vertices() != 0 && (header.num_vertices != mesh_.num_vertices() ||
+        header.num_indices != mesh_.num_indices()))
+    error_throw(ssprintf("Scene file %s has changed!", scene_file_name_.c_str()));
+  data += sizeof(Header);
+  auto vertices = reinterpret_cast<const Vertex*>(data);
+  data += header.num_vertices * sizeof(Vertex);
+  auto indices = reinterpret_cast<const GLuint*>(data);
+  // indices are also read on the host, by the CPU rasterizer
+  for (uint64_t i = 0; i < header.num_indices; ++i)
+    if (indices[i] >= header.num_vertices)
+      error_throw(ssprintf("Bad vertex index %u in scene file %s!",
+            indices[i], scene_file_name_.c_str()));
+  mesh_.set_external_data(vertices, header.num_vertices, indices, header.num_indices);
+}
+
+SUNCGScene::SUNCGScene(ObjLoader&& obj, unique_ptr<MappedFile> scene_file,
+    string model_category_file, string semantic_label_file, float minDepth,
+    VertexFormat vertex_format, int max_texture_size):
+  ObjSceneBase{move(obj)},
+  textures_{obj_.materials, obj_.base_dir, true, max_texture_size},
+  model_category_{model_category_file},
+  semantic_color_{semantic_label_file},
+  minDepth_{minDepth},
+  scene_file_{move(scene_file)}
+{
+  init_semantic_colors_();
+  parse_scene_file_();
+  mesh_.set_vertex_format(vertex_format);
+}
+
+void SUNCGScene::parse_scene_file_() {
+  const char* data = scene_file_->data();
+  auto& header = *reinterpret_cast<const Header*>(data);
+  boxmin_ = glm::vec3{header.boxmin[0], header.boxmin[1], header.boxmin[2]};
+  boxmax_ = glm::vec3{header.boxmax[0], header.boxmax[1], header.boxmax[2]};
+
+  map_scene_file_();
+  data += sizeof(Header) + header.num_vertices * sizeof(Vertex) +
+    header.num_indices * sizeof(GLuint);
+  auto meshes = reinterpret_cast<const MeshRecord*>(data);
+  data += header.num_meshes * sizeof(MeshRecord) + header.num_materials * sizeof(MaterialRecord);
+  const char* strings = data;
+
+  for (uint64_t i = 0; i < header.num_meshes; ++i) {
+    auto& rec = meshes[i];
+    if (rec.first < 0 || rec.count < 0 ||
+        (uint64_t)rec.first + rec.count > header.num_indices)
+      error_throw(ssprintf("Bad index range of mesh %lu in scene file %s!",
+            (unsigned long)i, scene_file_name_.c_str()));
+    if (rec.material < 0 || (uint64_t)rec.material >= header.num_materials)
+      error_throw(ssprintf("Bad material of mesh %lu in scene file %s!",
+            (unsigned long)i, scene_file_name_.c_str()));
+    mesh_.first.push_back(rec.first);
+    mesh_.count.push_back(rec.count);
+
+    string name = get_string(strings, header, rec.name, scene_file_name_);
+    // label colors are not saved, so that a file can be used with any label files
+    glm::vec3 label_color = get_color_by_shape_name(name);
+    glm::vec3 instance_color{rec.instance_color[0], rec.instance_color[1], rec.instance_color[2]};
+    instance_color_to_name_[instance_color_key(instance_color)] = name;
+
+    int mid = rec.material;
+    bool transparent = obj_.is_transparent_material(mid, textures_);
+    auto texture = textures_.get_layer(obj_.materials[mid].diffuse_texname);
+    materials_.emplace_back(MaterialDesc{
+        mid, label_color, instance_color, texture, transparent, &obj_.materials[mid]});
+  }
+  build_draw_groups_();
+}
+
+}   // namespace render
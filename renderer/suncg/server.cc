@@ -0,0 +1,407 @@
+// Copyright 2017-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the license found in the
+// LICENSE file in the root directory of this source tree.
+//File: server.cc
+
+#include "server.hh"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <stdexcept>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "lib/debugutils.hh"
+#include "lib/strutils.hh"
+
+using namespace std;
+using namespace render::server;
+
+namespace {
+
+// requests carry at most three paths
+const size_t MAX_MESSAGE_SIZE = sizeof(Request) + 3 * 4096;
+
+// Create an unlinked file of `size` bytes in shared memory, and return its descriptor or -1.
+int create_shared_file(size_t size) {
+  struct stat st;
+  string dir = "/dev/shm";
+  if (stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+    const char* tmpdir = getenv("TMPDIR");
+    dir = tmpdir ? tmpdir : "/tmp";
+  }
+  string path = dir + "/house3d-ring-XXXXXX";
+  int fd = mkstemp(&path[0]);
+  if (fd < 0)
+    return -1;
+  unlink(path.c_str());
+  if (ftruncate(fd, size) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Send a message with a file descriptor attached
+bool send_with_fd(int sock, const void* data, size_t size, int fd) {
+  iovec iov{const_cast<void*>(data), size};
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)size;
+}
+
+Reply make_reply(const Request& req) {
+  Reply reply;
+  memset(&reply, 0, sizeof(reply));
+  reply.type = req.type;
+  reply.scene = req.scene;
+  reply.slot = req.slot;
+  return reply;
+}
+
+// Send the reply followed by `text`.
+// A client that is gone is noticed by the main loop, so failures are ignored.
+// Sending never blocks: a client that doesn't read its replies is dropped, instead of
+// stalling the context that renders for it and all the clients behind it.
+void send_reply(int sock, const Reply& reply, const string& text = "") {
+  string msg(reinterpret_cast<const char*>(&reply), sizeof(reply));
+  msg += text;
+  if (send(sock, msg.data(), msg.size(), MSG_NOSIGNAL | MSG_DONTWAIT) < 0 &&
+      (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    print_debug("Dropping a client that doesn't read its replies\n");
+    // the main loop sees the end of the socket, and removes the client
+    shutdown(sock, SHUT_RDWR);
+  }
+}
+
+void send_error(int sock, const Request& req, const string& text) {
+  Reply reply = make_reply(req);
+  reply.status = 1;
+  send_reply(sock, reply, text);
+}
+
+}
+
+namespace render {
+
+struct RenderServer::Client {
+  int fd;
+  unsigned char* ring = nullptr;
+  size_t ring_size = 0;
+  // requests queued or running in the contexts, at most Options::num_slots
+  std::atomic<int> num_requests{0};
+  // prefetches are not counted, but only one of them is queued at a time
+  std::atomic<bool> prefetching{false};
+
+  explicit Client(int fd): fd{fd} {}
+  ~Client() {
+    if (ring)
+      munmap(ring, ring_size);
+    close(fd);
+  }
+
+  // Finish a request in flight. Called in the context threads.
+  void reply(const Reply& reply, const string& text = "") {
+    // before sending, so that the client can send another request once it has the reply
+    num_requests--;
+    send_reply(fd, reply, text);
+  }
+  void reply_error(const Request& req, const string& text) {
+    num_requests--;
+    send_error(fd, req, text);
+  }
+};
+
+RenderServer::RenderServer(const std::string& socket_path, const Options& options):
+  socket_path_{socket_path}, options_{options} {
+  if (options_.devices.empty() || options_.num_contexts <= 0 || options_.num_slots <= 0)
+    throw std::invalid_argument("RenderServer needs at least one device, context and slot!");
+  for (int i = 0; i < options_.num_contexts; ++i) {
+    int device = options_.devices[i % options_.devices.size()];
+    contexts_.emplace_back(new Context);
+    Context& ctx = *contexts_.back();
+    ctx.exec.execute_sync([&]() {
+          ctx.api.reset(new SUNCGRenderAPI{options_.w, options_.h, device, nullptr,
+                options_.backend, options_.num_threads});
+          ctx.api->setGPUMemoryBudget(options_.gpu_budget);
+        });
+  }
+
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (socket_path_.size() >= sizeof(addr.sun_path))
+    error_exit(ssprintf("Socket path %s is too long!", socket_path_.c_str()));
+  strcpy(addr.sun_path, socket_path_.c_str());
+  listen_fd_ = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (listen_fd_ < 0)
+    error_exit("Cannot create a unix socket!");
+  // a socket left by a previous server
+  unlink(socket_path_.c_str());
+  if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+    error_exit(ssprintf("Cannot bind to %s: %s", socket_path_.c_str(), strerror(errno)));
+  if (listen(listen_fd_, SOMAXCONN) != 0)
+    error_exit(ssprintf("Cannot listen on %s: %s", socket_path_.c_str(), strerror(errno)));
+}
+
+RenderServer::~RenderServer() {
+  close(listen_fd_);
+  unlink(socket_path_.c_str());
+  // the API is destroyed in its thread, after the jobs of the clients
+  for (auto& ctx : contexts_) {
+    Context* c = ctx.get();
+    c->exec.execute_sync([=]() { c->api.reset(); });
+    c->exec.stop();
+  }
+}
+
+void RenderServer::run() {
+  vector<pollfd> fds;
+  while (!stopped_) {
+    fds.clear();
+    fds.push_back(pollfd{listen_fd_, POLLIN, 0});
+    for (auto& kv : clients_)
+      fds.push_back(pollfd{kv.first, POLLIN, 0});
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      error_exit(ssprintf("poll failed: %s", strerror(errno)));
+    }
+    for (size_t i = 1; i < fds.size(); ++i) {
+      if (!fds[i].revents)
+        continue;
+      auto itr = clients_.find(fds[i].fd);
+      if (!handle_request_(itr->second))
+        clients_.erase(itr);  // closed once its pending jobs are done
+    }
+    if (fds[0].revents & POLLIN)
+      accept_client_();
+  }
+}
+
+void RenderServer::accept_client_() {
+  int fd = accept(listen_fd_, nullptr, nullptr);
+  if (fd < 0) {
+    print_debug("accept failed: %s\n", strerror(errno));
+    return;
+  }
+  shared_ptr<Client> client{new Client{fd}};
+
+  Hello hello;
+  memset(&hello, 0, sizeof(hello));
+  hello.version = PROTOCOL_VERSION;
+  hello.w = options_.w;
+  hello.h = options_.h;
+  hello.num_slots = options_.num_slots;
+  // large enough for all the modes, and 4 bytes per pixel in DEPTH_FLOAT is the largest
+  hello.slot_bytes = (uint64_t)options_.w * options_.h * sizeof(float);
+
+  client->ring_size = hello.slot_bytes * hello.num_slots;
+  int ring_fd = create_shared_file(client->ring_size);
+  if (ring_fd < 0) {
+    print_debug("Cannot create the frame ring: %s\n", strerror(errno));
+    return;
+  }
+  void* ptr = mmap(nullptr, client->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+  bool ok = ptr != MAP_FAILED;
+  if (ok) {
+    client->ring = static_cast<unsigned char*>(ptr);
+    ok = send_with_fd(fd, &hello, sizeof(hello), ring_fd);
+  }
+  // the client keeps the file alive with its own descriptor
+  close(ring_fd);
+  if (!ok) {
+    print_debug("Cannot set up the frame ring of a client: %s\n", strerror(errno));
+    return;
+  }
+  clients_[fd] = client;
+}
+
+bool RenderServer::handle_request_(const shared_ptr<Client>& client) {
+  vector<char> buf(MAX_MESSAGE_SIZE);
+  ssize_t size = recv(client->fd, buf.data(), buf.size(), 0);
+  if (size <= 0)
+    return false;
+  Request req;
+  if ((size_t)size < sizeof(req)) {
+    memset(&req, 0, sizeof(req));
+    send_error(client->fd, req, "Malformed request!");
+    return true;
+  }
+  memcpy(&req, buf.data(), sizeof(req));
+  // Without a limit, a client could fill the job queues of the contexts, and
+  // the main loop would wait for them. Prefetches are limited below.
+  if (req.type != (int32_t)RequestType::PREFETCH_SCENE &&
+      client->num_requests >= options_.num_slots) {
+    send_error(client->fd, req, ssprintf(
+          "Too many requests in flight! At most %d are allowed.", options_.num_slots));
+    return true;
+  }
+
+  switch (static_cast<RequestType>(req.type)) {
+    case RequestType::LOAD_SCENE:
+    case RequestType::PREFETCH_SCENE: {
+      vector<string> files;
+      const char* ptr = buf.data() + sizeof(req);
+      const char* end = buf.data() + size;
+      while (ptr < end && files.size() < 3) {
+        const char* str_end = static_cast<const char*>(memchr(ptr, '\0', end - ptr));
+        if (!str_end)
+          break;
+        files.emplace_back(ptr, str_end);
+        ptr = str_end + 1;
+      }
+      // prefetching is only a hint, and the errors are reported by LOAD_SCENE
+      bool reply_error = req.type == (int32_t)RequestType::LOAD_SCENE;
+      if (files.size() != 3) {
+        if (reply_error)
+          send_error(client->fd, req, "Malformed request!");
+        return true;
+      }
+      int id = add_scene_(files[0], files[1], files[2]);
+      Scene scene = scenes_[id];
+      Context& ctx = *contexts_[scene.context];
+      if (req.type == (int32_t)RequestType::PREFETCH_SCENE) {
+        if (client->prefetching.exchange(true))
+          return true;
+        // does nothing if the scene is loaded already
+        ctx.exec.execute_async([&ctx, client, scene]() {
+              try {
+                ctx.api->prefetchScene(
+                    scene.obj_file, scene.model_category_file, scene.semantic_label_file);
+              } catch (const std::exception&) {
+                // reported by the LOAD_SCENE that uses it
+              }
+              client->prefetching = false;
+            });
+        return true;
+      }
+      req.scene = id;
+      client->num_requests++;
+      ctx.exec.execute_async([this, &ctx, client, req, scene]() {
+            // a broken scene fails its own requests, not the server
+            try {
+              switch_scene_(ctx, req.scene, scene);
+            } catch (const std::exception& e) {
+              client->reply_error(req, e.what());
+              return;
+            }
+            Reply reply = make_reply(req);
+            Camera* camera = ctx.api->getCamera();
+            for (int k = 0; k < 3; ++k)
+              reply.pos[k] = camera->pos[k];
+            reply.yaw = camera->yaw;
+            reply.pitch = camera->pitch;
+            client->reply(reply);
+          });
+      return true;
+    }
+    case RequestType::RENDER:
+    case RequestType::GET_NAME:
+      break;
+    default:
+      send_error(client->fd, req, ssprintf("Unknown request type %d!", req.type));
+      return true;
+  }
+
+  if (req.scene < 0 || req.scene >= (int)scenes_.size()) {
+    send_error(client->fd, req, ssprintf("Scene %d is not loaded!", req.scene));
+    return true;
+  }
+  Scene scene = scenes_[req.scene];
+  Context& ctx = *contexts_[scene.context];
+
+  if (req.type == (int32_t)RequestType::GET_NAME) {
+    client->num_requests++;
+    ctx.exec.execute_async([this, &ctx, client, req, scene]() {
+          string name;
+          try {
+            switch_scene_(ctx, req.scene, scene);
+            name = ctx.api->getNameFromInstanceColor(req.color[0], req.color[1], req.color[2]);
+          } catch (const std::exception& e) {
+            client->reply_error(req, e.what());
+            return;
+          }
+          client->reply(make_reply(req), name);
+        });
+    return true;
+  }
+
+  if (req.slot < 0 || req.slot >= options_.num_slots) {
+    send_error(client->fd, req, ssprintf("Slot %d is out of range!", req.slot));
+    return true;
+  }
+  if (req.mode < 0 || req.mode > (int)SUNCGScene::RenderMode::DEPTH_FLOAT) {
+    send_error(client->fd, req, ssprintf("Unknown render mode %d!", req.mode));
+    return true;
+  }
+  unsigned char* dst = client->ring + req.slot * (size_t)options_.w * options_.h * sizeof(float);
+  client->num_requests++;
+  ctx.exec.execute_async([this, &ctx, client, req, scene, dst]() {
+        try {
+          switch_scene_(ctx, req.scene, scene);
+          ctx.api->setMode(static_cast<SUNCGScene::RenderMode>(req.mode));
+          Camera& camera = *ctx.api->getCamera();
+          camera.pos = glm::vec3{req.pos[0], req.pos[1], req.pos[2]};
+          camera.yaw = req.yaw;
+          camera.pitch = req.pitch;
+          camera.near = req.near;
+          camera.far = req.far;
+          camera.vertical_fov = req.vertical_fov;
+          camera.updateDirection();
+          ctx.api->render(dst);
+        } catch (const std::exception& e) {
+          client->reply_error(req, e.what());
+          return;
+        }
+        client->reply(make_reply(req));
+      });
+  return true;
+}
+
+int RenderServer::add_scene_(const string& obj_file, const string& model_category_file,
+    const string& semantic_label_file) {
+  // same as the scene cache of SUNCGRenderAPI
+  auto itr = scene_ids_.find(obj_file);
+  if (itr != scene_ids_.end())
+    return itr->second;
+  // the context with the fewest scenes
+  int best = 0;
+  for (int i = 1; i < (int)contexts_.size(); ++i)
+    if (contexts_[i]->num_scenes < contexts_[best]->num_scenes)
+      best = i;
+  contexts_[best]->num_scenes++;
+  int id = scenes_.size();
+  scenes_.push_back(Scene{obj_file, model_category_file, semantic_label_file, best});
+  scene_ids_[obj_file] = id;
+  return id;
+}
+
+void RenderServer::switch_scene_(Context& ctx, int id, const Scene& scene) {
+  if (ctx.current_scene == id)
+    return;
+  // the scene is taken from the cache after the first time
+  ctx.api->loadScene(scene.obj_file, scene.model_category_file, scene.semantic_label_file);
+  ctx.current_scene = id;
+}
+
+}
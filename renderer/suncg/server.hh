@@ -0,0 +1,143 @@
+// Copyright 2017-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the license found in the
+// LICENSE file in the root directory of this source tree.
+//File: server.hh
+
+#pragma once
+
+#include <csignal>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "render.hh"
+#include "lib/executor.hh"
+
+namespace render {
+
+// Wire format of the render server, see render-server.cpp and House3D/renderclient.py.
+// Messages are sent over a SOCK_SEQPACKET unix socket, one struct per message,
+// in native byte order. Frames are not sent over the socket: each client has a
+// ring of frame slots in shared memory, and a RENDER request names the slot to write to.
+namespace server {
+
+const uint32_t PROTOCOL_VERSION = 1;
+
+enum class RequestType : int32_t {
+  // followed by three null-terminated strings:
+  // obj_file, model_category_file, semantic_label_file (see SUNCGRenderAPI::loadScene)
+  LOAD_SCENE = 1,
+  PREFETCH_SCENE = 2,   // same as LOAD_SCENE, but never replied
+  RENDER = 3,
+  GET_NAME = 4          // getNameFromInstanceColor
+};
+
+struct Request {
+  int32_t type;         // RequestType
+  int32_t scene;        // scene id returned by LOAD_SCENE
+  int32_t mode;         // SUNCGScene::RenderMode
+  int32_t slot;         // the frame slot to render into
+  // the camera pose
+  float pos[3], yaw, pitch, near, far, vertical_fov;
+  int32_t color[3];     // GET_NAME only
+};
+
+struct Reply {
+  int32_t type;         // RequestType of the request
+  int32_t status;       // 0 on success. Otherwise an error message follows.
+  int32_t scene;
+  int32_t slot;
+  // the initial camera of the scene, for LOAD_SCENE
+  float pos[3], yaw, pitch;
+  // followed by the name for GET_NAME
+};
+
+// Sent once to each new client, with the file descriptor of its frame ring.
+struct Hello {
+  uint32_t version;     // PROTOCOL_VERSION
+  int32_t w, h;
+  int32_t num_slots;
+  uint64_t slot_bytes;  // slot i starts at i * slot_bytes of the ring
+};
+
+static_assert(sizeof(Request) == 60, "Request has to match House3D/renderclient.py!");
+static_assert(sizeof(Reply) == 36, "Reply has to match House3D/renderclient.py!");
+static_assert(sizeof(Hello) == 24, "Hello has to match House3D/renderclient.py!");
+
+}   // namespace server
+
+
+// Serve many client processes with a fixed set of GL contexts.
+// Each scene (identified by its obj_file) is loaded on one of the contexts, and
+// stays there for the lifetime of the server, so scenes are built and uploaded once no matter how many clients use them.
+// The contexts render in parallel, each in its own thread.
+// The scenes loaded on a context stay on its GPU as long as they fit into the GPU budget.
+class RenderServer {
+  public:
+    struct Options {
+      int w = 120, h = 90;
+      // contexts are created on the devices in turn
+      std::vector<int> devices{0};
+      int num_contexts = 1;
+      // of each context. See SUNCGRenderAPI::setGPUMemoryBudget().
+      size_t gpu_budget = std::numeric_limits<size_t>::max();
+      // frame slots of each client, i.e. the number of frames it can have in flight.
+      // It also limits the requests in flight of a client: more are replied with an error.
+      int num_slots = 4;
+      // of the contexts, see SUNCGRenderAPI()
+      GLBackend backend = GLBackend::AUTO;
+      int num_threads = 0;
+    };
+
+    RenderServer(const std::string& socket_path, const Options& options);
+    ~RenderServer();
+
+    RenderServer(const RenderServer&) = delete;
+    RenderServer& operator = (const RenderServer&) = delete;
+
+    // Accept and serve clients until stop() is called.
+    void run();
+
+    // Can be called from a signal handler.
+    void stop() { stopped_ = 1; }
+
+  private:
+    struct Client;
+    struct Context {
+      std::unique_ptr<SUNCGRenderAPI> api;
+      // the scene used by the last request, i.e. the current scene of api
+      int current_scene = -1;
+      int num_scenes = 0;
+      ExecutorInThread exec;
+    };
+    struct Scene {
+      std::string obj_file, model_category_file, semantic_label_file;
+      int context;
+    };
+
+    std::string socket_path_;
+    Options options_;
+    int listen_fd_ = -1;
+    volatile sig_atomic_t stopped_ = 0;
+
+    std::vector<std::unique_ptr<Context>> contexts_;
+    std::vector<Scene> scenes_;
+    std::unordered_map<std::string, int> scene_ids_;  // by obj_file
+    std::unordered_map<int, std::shared_ptr<Client>> clients_;  // by socket
+
+    void accept_client_();
+    // return false if the client is disconnected
+    bool handle_request_(const std::shared_ptr<Client>& client);
+    // the id of the scene, which is added to a context if it's new
+    int add_scene_(const std::string& obj_file, const std::string& model_category_file,
+        const std::string& semantic_label_file);
+    // Make `scene` the current scene of its context. Runs in the context thread.
+    void switch_scene_(Context& ctx, int id, const Scene& scene);
+};
+
+}
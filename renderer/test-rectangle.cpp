@@ -49,6 +49,16 @@ int main(int argc, char* argv[]) {
     render::EGLContext ctx{geo};
     ctx.printInfo();
 
+    Framebuffer fb{geo};
+    FramebufferScope fbs{fb};
+    RectangleScene sc;
+    sc.draw();
+    auto mat = fb.capture();
+    write_rgb("out.jpg", mat);
+  } else if (cmd == "software") {
+    render::SoftwareEGLContext ctx{geo};
+    ctx.printInfo();
+
     Framebuffer fb{geo};
     FramebufferScope fbs{fb};
     RectangleScene sc;
@@ -13,11 +13,15 @@ import random
 
 from House3D import objrender
 from House3D import Environment, create_default_config
+from House3D.renderclient import RenderClient
 
 
 def worker(idx, house_id, device):
     colormapFile = "../metadata/colormap_coarse.csv"
-    api = objrender.RenderAPI(w=args.width, h=args.height, device=device)
+    if args.server:
+        api = RenderClient(args.server)
+    else:
+        api = objrender.RenderAPI(w=args.width, h=args.height, device=device)
     env = Environment(api, house_id, cfg)
     N = 15000
     start = time.time()
@@ -45,6 +49,9 @@ if __name__ == '__main__':
     1proc, 1gpu: 708fps
     3proc, 1gpu: 556x3fps, 52% GPU util
     5proc, 1gpu: 430x5fps, 71% GPU util
+
+    With --server, all processes render through one render-server.bin, started with e.g.:
+    ./render-server.bin -w 120 -h 90 -d 0 /tmp/house3d.sock
     """
     parser = argparse.ArgumentParser()
     parser.add_argument('obj')
@@ -52,6 +59,8 @@ if __name__ == '__main__':
     parser.add_argument('--num-gpu', type=int, default=1)
     parser.add_argument('--width', type=int, default=120)
     parser.add_argument('--height', type=int, default=90)
+    parser.add_argument('--server', help='socket of render-server.bin; '
+                        'the resolution and GPUs are the ones of the server')
     args = parser.parse_args()
 
     prefix = os.path.dirname(os.path.dirname(args.obj))
@@ -16,7 +16,11 @@ from House3D import objrender, create_default_config
 from House3D.objrender import Camera, RenderMode
 
 def worker(idx, device, num_iter):
-    api = objrender.RenderAPI(args.width, args.height, device=device)
+    if args.software:
+        api = objrender.RenderAPI(args.width, args.height, backend=objrender.GLBackend.SOFTWARE,
+                                  num_threads=args.num_threads)
+    else:
+        api = objrender.RenderAPI(args.width, args.height, device=device)
     api.printContextInfo()
     mappingFile = cfg['modelCategoryFile']
     colormapFile = cfg['colorFile']
@@ -31,7 +35,16 @@ def worker(idx, device, num_iter):
             api.setMode(RenderMode.RGB)
         else:
             api.setMode(RenderMode.SEMANTIC)
-        mat = np.array(api.render(), copy=False)
+        if args.pipeline:
+            # keep the queue full, and fetch the oldest frame
+            api.renderAsync()
+            if api.numPendingFrames() < args.pipeline:
+                continue
+            mat = np.array(api.fetch(), copy=False)
+        else:
+            mat = np.array(api.render(), copy=False)
+    while args.pipeline and api.numPendingFrames():
+        mat = np.array(api.fetch(), copy=False)
     end = time.time()
     print("Worker {}, speed {:.3f} fps".format(idx, num_iter / (end - start)))
 
@@ -66,6 +79,12 @@ if __name__ == '__main__':
     parser.add_argument('--width', type=int, default=120)
     parser.add_argument('--height', type=int, default=90)
     parser.add_argument('--num-iter', type=int, default=5000)
+    parser.add_argument('--pipeline', type=int, default=0,
+                        help='number of frames in flight with renderAsync/fetch. 0 to use render()')
+    parser.add_argument('--software', action='store_true',
+                        help='render on CPU with the software backend. --num-gpu is ignored')
+    parser.add_argument('--num-threads', type=int, default=0,
+                        help='rasterizer threads of each process with --software. 0 for one per CPU')
     args = parser.parse_args()
 
     global cfg
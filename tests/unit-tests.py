@@ -6,10 +6,14 @@
 
 import numpy as np
 import os
+import subprocess
+import tempfile
+import time
 import unittest
 
 from House3D import objrender, Environment, load_config, House
 from House3D.objrender import RenderMode
+from House3D.renderclient import RenderClient
 
 PIXEL_MAX = np.iinfo(np.uint16).max
 ROOM_TYPE = 'kitchen'
@@ -48,6 +52,24 @@ def find_first_good_house(cfg):
             return (house_id, house)
 
 
+def render_with_apis(make_api, args, mode):
+    '''Render the same view of the first good house, with an API created by
+    make_api(arg, house, cfg) for each arg in args.'''
+    cfg = load_config('config.json')
+    houseID, house = find_first_good_house(cfg)
+    images = []
+    for arg in args:
+        api = make_api(arg, house, cfg)
+        env = Environment(api, house, cfg)
+        env.reset(*house.getRandomLocation(ROOM_TYPE))
+        if images:
+            env.cam.pos, env.cam.yaw = pos, yaw
+            env.cam.updateDirection()
+        pos, yaw = env.cam.pos, env.cam.yaw
+        images.append(env.render(mode, copy=True))
+    return images
+
+
 class TestCubeMap(unittest.TestCase):
     def test_render(self):
         api = objrender.RenderAPI(w=SIDE, h=SIDE, device=0)
@@ -96,5 +118,292 @@ class TestCubeMap(unittest.TestCase):
             depth2[0, 0], depth_value, delta=depth_value * 0.05)
 
 
+class TestDepthFloat(unittest.TestCase):
+    def test_render(self):
+        api = objrender.RenderAPI(w=SIDE, h=SIDE, device=0)
+        cfg = load_config('config.json')
+        houseID, house = find_first_good_house(cfg)
+        env = Environment(api, house, cfg)
+        location = house.getRandomLocation(ROOM_TYPE)
+        env.reset(*location)
+
+        depth = env.render('depth_float', copy=True)
+        self.assertEqual(depth.dtype, np.float32)
+        self.assertEqual(depth.shape, (SIDE, SIDE))
+
+        # Compare with the 8-bit DEPTH mode, where it is not infinity or clipped
+        depth8 = env.render('depth', copy=True)
+        depth8_value = depth8[:, :, 0] * 20.0 / 255.0
+        valid = (depth8[:, :, 1] == 0) & (depth8[:, :, 0] < 255)
+        self.assertTrue(np.all(np.isinf(depth[depth8[:, :, 1] > 0])))
+        self.assertTrue(np.allclose(depth[valid], depth8_value[valid], atol=20.0 / 255.0))
+
+
+class TestRenderMulti(unittest.TestCase):
+    def test_render(self):
+        api = objrender.RenderAPI(w=SIDE, h=SIDE, device=0)
+        cfg = load_config('config.json')
+        houseID, house = find_first_good_house(cfg)
+        env = Environment(api, house, cfg)
+        location = house.getRandomLocation(ROOM_TYPE)
+        env.reset(*location)
+
+        modes = ['rgb', 'semantic', 'instance', 'depth', 'invdepth']
+        imgs = env.render_multi(modes, copy=True)
+        self.assertEqual(len(imgs), len(modes))
+        # Each output should match the corresponding single-mode rendering
+        for mode, img in zip(modes, imgs):
+            single = env.render(mode, copy=True)
+            self.assertEqual(img.shape, single.shape)
+            self.assertTrue(np.array_equal(img, single), mode)
+
+
+class TestRenderToArray(unittest.TestCase):
+    def test_render(self):
+        api = objrender.RenderAPI(w=SIDE, h=SIDE, device=0)
+        cfg = load_config('config.json')
+        houseID, house = find_first_good_house(cfg)
+        env = Environment(api, house, cfg)
+        location = house.getRandomLocation(ROOM_TYPE)
+        env.reset(*location)
+
+        out = np.zeros((SIDE, SIDE, 3), dtype=np.uint8)
+        ret = env.render('rgb', out=out)
+        self.assertIs(ret, out)
+        self.assertTrue(np.array_equal(out, env.render('rgb', copy=True)))
+
+        batch = np.zeros((3, SIDE, SIDE, 2), dtype=np.uint8)
+        env.render('depth', out=batch, index=1)
+        self.assertTrue(np.array_equal(batch[1], env.render('depth', copy=True)))
+        self.assertFalse(batch[0].any())
+
+        with self.assertRaises(ValueError):
+            env.render('depth', out=out)
+
+
+class TestRenderBatch(unittest.TestCase):
+    def test_render(self):
+        api = objrender.RenderAPI(w=SIDE, h=SIDE, device=0)
+        cfg = load_config('config.json')
+        houseID, house = find_first_good_house(cfg)
+        env = Environment(api, house, cfg)
+        location = house.getRandomLocation(ROOM_TYPE)
+        env.reset(*location)
+
+        cam = env.cam
+        cameras = [objrender.Camera(cam.pos, cam.yaw + 90 * k, cam.pitch) for k in range(4)]
+        for mode in ['rgb', 'depth', 'depth_float']:
+            batch = env.render_batch(cameras, mode)
+            self.assertEqual(batch.shape[0], len(cameras))
+            for k, c in enumerate(cameras):
+                cam.pos, cam.yaw, cam.pitch = c.pos, c.yaw, c.pitch
+                cam.updateDirection()
+                self.assertTrue(np.array_equal(batch[k], env.render(mode, copy=True)))
+
+
+class TestCubeMapSinglePass(unittest.TestCase):
+    def test_render(self):
+        api = objrender.RenderAPI(w=SIDE, h=SIDE, device=0)
+        cfg = load_config('config.json')
+        houseID, house = find_first_good_house(cfg)
+        env = Environment(api, house, cfg)
+        location = house.getRandomLocation(ROOM_TYPE)
+        env.reset(*location)
+
+        cam = env.cam
+        yaw = cam.yaw
+        cube = env.render_cube_map('rgb', copy=True)
+        self.assertEqual(cube.shape, (SIDE, SIDE * 6, 3))
+        self.assertEqual(cam.yaw, yaw)
+
+        # the FORWARD face
+        cam.vertical_fov, cam.pitch = 90, 0
+        cam.updateDirection()
+        self.assertTrue(np.array_equal(cube[:, SIDE * 2:SIDE * 3], env.render('rgb')))
+
+
+class TestVertexFormat(unittest.TestCase):
+    def test_compact(self):
+        def make_api(fmt, house, cfg):
+            api = objrender.RenderAPI(w=SIDE, h=SIDE, device=0)
+            api.setVertexFormat(fmt)
+            return api
+
+        images = render_with_apis(
+            make_api,
+            [objrender.VertexFormat.FLOAT, objrender.VertexFormat.COMPACT],
+            'semantic')
+        # positions are exact, so only a few pixels on the edges may differ
+        diff = (images[0] != images[1]).any(axis=2).mean()
+        self.assertLess(diff, 0.01)
+
+
+class TestMaxTextureSize(unittest.TestCase):
+    def test_downscale(self):
+        api = objrender.RenderAPI(w=SIDE, h=SIDE, device=0)
+        self.assertEqual(api.getMaxTextureSize(), SIDE)
+
+        def make_api(size, house, cfg):
+            api = objrender.RenderAPI(w=SIDE, h=SIDE, device=0)
+            api.setMaxTextureSize(size)
+            return api
+
+        images = render_with_apis(make_api, [0, 16], 'rgb')
+        # the textures are blurred, but their average colors are kept
+        diff = np.abs(images[0].astype(np.float32) - images[1].astype(np.float32))
+        self.assertGreater(diff.max(), 0)
+        self.assertLess(diff.mean(), 32)
+
+
+class TestPrefetch(unittest.TestCase):
+    def test_prefetch(self):
+        def make_api(prefetch, house, cfg):
+            api = objrender.RenderAPI(w=SIDE, h=SIDE, device=0)
+            if prefetch:
+                api.prefetchScene(house.objFile, house.metaDataFile, cfg['colorFile'])
+            return api
+
+        images = render_with_apis(make_api, [False, True], 'rgb')
+        self.assertTrue((images[0] == images[1]).all())
+
+
+class TestReleaseHostData(unittest.TestCase):
+    def test_render(self):
+        def make_api(release, house, cfg):
+            api = objrender.RenderAPI(w=SIDE, h=SIDE, device=0)
+            api.setReleaseHostData(release)
+            return api
+
+        # don't write house.h3d next to the test data
+        os.environ['HOUSE3D_SCENE_CACHE'] = tempfile.mkdtemp()
+        try:
+            images = render_with_apis(make_api, [False, True], 'rgb')
+        finally:
+            del os.environ['HOUSE3D_SCENE_CACHE']
+        self.assertTrue((images[0] == images[1]).all())
+
+
+class TestRenderAsyncFuture(unittest.TestCase):
+    def test_render(self):
+        api = objrender.RenderAPIThread(w=SIDE, h=SIDE, device=0)
+        cfg = load_config('config.json')
+        houseID, house = find_first_good_house(cfg)
+        env = Environment(api, house, cfg)
+        env.reset(*house.getRandomLocation(ROOM_TYPE))
+        env.set_render_mode('rgb')
+
+        cam = env.cam
+        yaw = cam.yaw
+        futures = []
+        for k in range(4):
+            # the camera is captured when the frame is queued
+            cam.yaw = yaw + 90 * k
+            cam.updateDirection()
+            futures.append(api.renderAsync())
+        self.assertEqual(api.numPendingFrames(), 4)
+        for k, f in enumerate(futures):
+            cam.yaw = yaw + 90 * k
+            cam.updateDirection()
+            self.assertTrue(np.array_equal(np.array(f.get()), env.render(copy=True)))
+        # the same frames, in order
+        self.assertTrue(np.array_equal(np.array(api.fetch()), np.array(futures[0].get())))
+        self.assertEqual(api.numPendingFrames(), 3)
+
+
+class TestShareGroup(unittest.TestCase):
+    def test_render(self):
+        cfg = load_config('config.json')
+        houseID, house = find_first_good_house(cfg)
+        api = objrender.RenderAPIThread(w=SIDE, h=SIDE, device=0)
+        shared = objrender.RenderAPIThread(w=SIDE, h=SIDE, device=0, share=api)
+        envs = [Environment(a, house, cfg) for a in [api, shared]]
+        envs[0].reset(*house.getRandomLocation(ROOM_TYPE))
+        envs[1].cam.pos, envs[1].cam.yaw = envs[0].cam.pos, envs[0].cam.yaw
+        envs[1].cam.updateDirection()
+        for mode in ['rgb', 'semantic', 'depth']:
+            self.assertTrue(np.array_equal(
+                envs[0].render(mode, copy=True), envs[1].render(mode, copy=True)))
+        # the shared objects outlive the instance that uploaded them
+        del envs[0], api
+        self.assertEqual(envs[0].render('rgb', copy=True).shape, (SIDE, SIDE, 3))
+
+
+class TestSoftwareBackend(unittest.TestCase):
+    def test_render(self):
+        cfg = load_config('config.json')
+        houseID, house = find_first_good_house(cfg)
+        api = objrender.RenderAPI(w=SIDE, h=SIDE, device=0)
+        sw_api = objrender.RenderAPIThread(
+            w=SIDE, h=SIDE, backend=objrender.GLBackend.SOFTWARE, num_threads=2)
+        envs = [Environment(a, house, cfg) for a in [api, sw_api]]
+        envs[0].reset(*house.getRandomLocation(ROOM_TYPE))
+        envs[1].cam.pos, envs[1].cam.yaw = envs[0].cam.pos, envs[0].cam.yaw
+        envs[1].cam.updateDirection()
+        # rasterizers differ on the edges
+        for mode in ['semantic', 'instance']:
+            expected = envs[0].render(mode, copy=True)
+            img = envs[1].render(mode, copy=True)
+            self.assertEqual(img.shape, expected.shape)
+            same = np.all(img == expected, axis=2).mean()
+            self.assertGreater(same, 0.95)
+
+
+class TestCPURasterizer(unittest.TestCase):
+    def test_render(self):
+        cfg = load_config('config.json')
+        houseID, house = find_first_good_house(cfg)
+        api = objrender.RenderAPI(w=SIDE, h=SIDE, device=0)
+        env = Environment(api, house, cfg)
+        env.reset(*house.getRandomLocation(ROOM_TYPE))
+        modes = ['semantic', 'instance', 'depth', 'depth_float']
+        expected = [env.render(mode, copy=True) for mode in modes]
+        api.setCPURasterizer(True, num_threads=2)
+        # rasterizers differ on the edges
+        for mode, exp in zip(modes, expected):
+            img = env.render(mode, copy=True)
+            self.assertEqual(img.shape, exp.shape)
+            if mode == 'depth_float':
+                same = np.isclose(img, exp, rtol=1e-3).mean()
+            else:
+                same = np.all(img == exp, axis=-1).mean()
+            self.assertGreater(same, 0.95)
+        api.setCPURasterizer(False)
+        self.assertTrue(np.array_equal(env.render('semantic', copy=True), expected[0]))
+
+
+class TestRenderServer(unittest.TestCase):
+    def test_render(self):
+        cfg = load_config('config.json')
+        houseID, house = find_first_good_house(cfg)
+        server_bin = os.path.join(os.path.dirname(__file__), '..', 'renderer', 'render-server.bin')
+        socket_path = os.path.join(tempfile.mkdtemp(), 'house3d.sock')
+        server = subprocess.Popen([server_bin, '-w', str(SIDE), '-h', str(SIDE), socket_path])
+        try:
+            while not os.path.exists(socket_path):
+                time.sleep(0.1)
+            clients = [RenderClient(socket_path) for _ in range(2)]
+            envs = [Environment(c, house, cfg) for c in clients]
+            envs[0].reset(*house.getRandomLocation(ROOM_TYPE))
+            api = objrender.RenderAPI(w=SIDE, h=SIDE, device=0)
+            local_env = Environment(api, house, cfg)
+            for env in envs[1:] + [local_env]:
+                env.cam.pos, env.cam.yaw = envs[0].cam.pos, envs[0].cam.yaw
+                env.cam.updateDirection()
+            for mode in ['rgb', 'depth', 'depth_float']:
+                expected = local_env.render(mode, copy=True)
+                for env in envs:
+                    self.assertTrue(np.array_equal(env.render(mode), expected))
+
+            clients[0].renderAsync()
+            clients[0].renderAsync()
+            self.assertEqual(clients[0].numPendingFrames(), 2)
+            self.assertTrue(np.array_equal(clients[0].fetch(), clients[0].fetch()))
+            for c in clients:
+                c.close()
+        finally:
+            server.terminate()
+            server.wait()
+
+
 if __name__ == '__main__':
     unittest.main()